@@ -0,0 +1,123 @@
+import subprocess
+import os
+import sys
+import json
+import time
+import tempfile
+
+# Benchmark for myshell. Build the shell first:
+#   gcc -O2 -Wall -o myshell shell.c myshell.c
+# then run:
+#   python3 bench.py [--shell ./myshell] [--output results.json]
+# Results are printed as one JSON object (and written to --output if given) so runs can be diffed.
+
+SHELL_EXECUTABLE = "./myshell"
+LAUNCH_COMMANDS = 5000            # Number of `true` invocations for the launch latency test
+PIPE_FILE_SIZE = 256 * 1024 * 1024 # Size of the file pushed through `cat | wc -c`
+PIPE_RUNS = 5
+REDIRECT_ROUNDS = 1000            # Each round does one >, one >> and one < redirection
+
+def run_shell(script):
+    # Feed a script to the shell on stdin. Returns (wall seconds, stdout, stderr)
+    start = time.perf_counter()
+    result = subprocess.run([SHELL_EXECUTABLE], input=script.encode(),
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError(f"shell exited with {result.returncode}: {result.stderr.decode()}")
+    return wall, result.stdout.decode(), result.stderr.decode()
+
+def time_reports(stderr):
+    # Parse the "real Xs  user Xs ..." lines printed by the `time` prefix into dicts
+    reports = []
+    for line in stderr.splitlines():
+        if not line.startswith("real "):
+            continue
+        fields = line.split()
+        reports.append({
+            "real": float(fields[1].rstrip("s")),
+            "user": float(fields[3].rstrip("s")),
+            "sys": float(fields[5].rstrip("s")),
+        })
+    return reports
+
+def percentile(values, p):
+    ordered = sorted(values)
+    index = min(len(ordered) - 1, int(round(p / 100.0 * (len(ordered) - 1))))
+    return ordered[index]
+
+def bench_launch():
+    # (a) Fork/exec/wait latency of a trivial command, as seen by the shell itself
+    wall, _, stderr = run_shell("time true\n" * LAUNCH_COMMANDS)
+    latencies = [r["real"] * 1e6 for r in time_reports(stderr)]
+    return {
+        "commands": LAUNCH_COMMANDS,
+        "commands_per_sec": LAUNCH_COMMANDS / wall,
+        "latency_us": {f"p{p}": percentile(latencies, p) for p in (50, 90, 99, 99.9)},
+        "latency_us_max": max(latencies),
+    }
+
+def bench_pipe(workdir):
+    # (b) Throughput of the pipe process_arglist sets up between two stages
+    path = os.path.join(workdir, "bigfile")
+    with open(path, "wb") as f:
+        chunk = b"A" * (1024 * 1024)
+        for _ in range(PIPE_FILE_SIZE // len(chunk)):
+            f.write(chunk)
+    _, stdout, stderr = run_shell(f"time cat {path} | wc -c\n" * PIPE_RUNS)
+    counts = [int(line) for line in stdout.split()]
+    if any(count != PIPE_FILE_SIZE for count in counts):
+        raise RuntimeError(f"pipe lost data: {counts}")
+    rates = [PIPE_FILE_SIZE / r["real"] / 1e9 for r in time_reports(stderr)]
+    return {
+        "bytes": PIPE_FILE_SIZE,
+        "runs": PIPE_RUNS,
+        "gb_per_sec": {"min": min(rates), "median": percentile(rates, 50), "max": max(rates)},
+    }
+
+def bench_redirect(workdir):
+    # (c) A redirection-heavy script: truncate, append and read back a small file
+    path = os.path.join(workdir, "redirect.txt")
+    script = (f"echo first > {path}\n"
+              f"echo second >> {path}\n"
+              f"wc -l < {path}\n") * REDIRECT_ROUNDS
+    wall, stdout, _ = run_shell(script)
+    if stdout.split() != ["2"] * REDIRECT_ROUNDS:
+        raise RuntimeError("redirections produced unexpected output")
+    return {
+        "commands": 3 * REDIRECT_ROUNDS,
+        "commands_per_sec": 3 * REDIRECT_ROUNDS / wall,
+        "wall_sec": wall,
+    }
+
+def main():
+    global SHELL_EXECUTABLE
+    output = None
+    args = sys.argv[1:]
+    while args:
+        if args[0] == "--shell" and len(args) > 1:
+            SHELL_EXECUTABLE = args[1]
+        elif args[0] == "--output" and len(args) > 1:
+            output = args[1]
+        else:
+            print(f"usage: {sys.argv[0]} [--shell PATH] [--output FILE]", file=sys.stderr)
+            sys.exit(1)
+        args = args[2:]
+
+    with tempfile.TemporaryDirectory() as workdir:
+        results = {
+            "shell": os.path.abspath(SHELL_EXECUTABLE),
+            "timestamp": time.time(),
+            "launch": bench_launch(),
+            "pipe": bench_pipe(workdir),
+            "redirect": bench_redirect(workdir),
+        }
+
+    text = json.dumps(results, indent=2)
+    print(text)
+    if output is not None:
+        with open(output, "w") as f:
+            f.write(text + "\n")
+
+if __name__ == "__main__":
+    main()
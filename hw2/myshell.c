@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,16 +8,1016 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define MAX_TRACKED 256   // Maximum number of children tracked at once
+#define MAX_COMMANDS 128  // Maximum number of distinct command names in the stats table
+#define CMD_NAME_LEN 64   // Maximum stored length of a command name
+#define HIST_BUCKETS 24   // Wall time histogram buckets, bucket i holds [2^i, 2^(i+1)) microseconds
+#define SERVE_MAX_CLIENTS 64    // Maximum concurrent connections in server mode
+#define SERVE_MAX_REQUESTS 128  // Maximum commands executing at once in server mode
+#define SERVE_LINE_MAX 4096     // Maximum length of one command line in server mode
+#define MOVE_CHUNK (1 << 20)    // Bytes requested per copy_file_range/splice call in file stages
+#define GLOB_CACHE_DIRS 64      // Directory listings kept for glob expansion
+
+// Resource usage of one or more reaped children
+typedef struct {
+    double wall;    // Elapsed wall-clock seconds
+    double user;    // User CPU seconds
+    double sys;     // System CPU seconds
+    long maxrss;    // Peak resident set size in KB
+    long csw;       // Voluntary + involuntary context switches
+} Usage;
+
+// Usage aggregated over every run of one command name
+typedef struct {
+    char name[CMD_NAME_LEN];
+    unsigned long runs;
+    Usage total;
+    unsigned long hist[HIST_BUCKETS];
+} CommandStats;
+
+// A child that has been forked but not yet reaped
+typedef struct {
+    pid_t pid;              // 0 if the slot is free
+    int cmd;                // Index into commandStats, -1 if the command is not accounted
+    int background;         // Reaped by the SIGCHLD handler rather than by wait_child
+    struct timespec start;  // Time of the fork
+} TrackedChild;
+
+static TrackedChild tracked[MAX_TRACKED];
+static CommandStats commandStats[MAX_COMMANDS];
+static int commandCount = 0;
+static sigset_t prevMask;   // Signal mask saved by block_sigchld
+static int lastStatus = 0;  // Wait status of the last foreground child
+static volatile sig_atomic_t interrupted = 0; // Set by SIGINT, stops an in-shell file stage
+
+int process_arglist(int count, char **arglist);
+static void prime_glob_cache(const char *line);
+
+// Block SIGCHLD so the handler can't reap or account a child we are about to wait for
+static void block_sigchld(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prevMask);
+}
+
+// Restore the mask saved by block_sigchld (also used by children before exec)
+static void unblock_sigchld(void) {
+    sigprocmask(SIG_SETMASK, &prevMask, NULL);
+}
+
+// Seconds elapsed between two timespecs
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Add one usage sample into an aggregate (peak RSS is a maximum, not a sum)
+static void add_usage(Usage *acc, const Usage *u) {
+    acc->wall += u->wall;
+    acc->user += u->user;
+    acc->sys += u->sys;
+    acc->csw += u->csw;
+    if (u->maxrss > acc->maxrss) {
+        acc->maxrss = u->maxrss;
+    }
+}
+
+// Find the stats slot for a command name, creating it if needed. Returns -1 if the table is full
+static int command_slot(const char *name) {
+    for (int i = 0; i < commandCount; i++) {
+        if (strncmp(commandStats[i].name, name, CMD_NAME_LEN - 1) == 0) {
+            return i;
+        }
+    }
+    if (commandCount == MAX_COMMANDS) {
+        return -1;
+    }
+    memset(&commandStats[commandCount], 0, sizeof(CommandStats));
+    strncpy(commandStats[commandCount].name, name, CMD_NAME_LEN - 1);
+    return commandCount++;
+}
+
+// Find a free tracking slot, or -1 if MAX_TRACKED children are already running
+static int free_slot(void) {
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        if (tracked[i].pid == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Remember a freshly forked child so its usage can be accounted when it is reaped.
+// Must be called with SIGCHLD blocked
+static void track_child(pid_t pid, const char *name, int background) {
+    int i = free_slot();
+    if (i == -1) {
+        return; // Only foreground children get here with a full table; they are still waited for
+    }
+    tracked[i].pid = pid;
+    tracked[i].cmd = command_slot(name);
+    tracked[i].background = background;
+    clock_gettime(CLOCK_MONOTONIC, &tracked[i].start);
+}
+
+// Account a reaped child. Only touches preallocated memory, so it is safe to call from the SIGCHLD handler
+static void record_exit(pid_t pid, const struct rusage *ru, Usage *out) {
+    struct timespec now;
+    Usage u;
+    int bucket;
+    long micros;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        if (tracked[i].pid != pid) {
+            continue;
+        }
+        u.wall = elapsed(&tracked[i].start, &now);
+        u.user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+        u.sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+        u.maxrss = ru->ru_maxrss;
+        u.csw = ru->ru_nvcsw + ru->ru_nivcsw;
+        tracked[i].pid = 0;
+
+        if (tracked[i].cmd >= 0) {
+            CommandStats *cs = &commandStats[tracked[i].cmd];
+            cs->runs++;
+            add_usage(&cs->total, &u);
+            micros = (long) (u.wall * 1e6);
+            for (bucket = 0; bucket < HIST_BUCKETS - 1 && micros >= (2L << bucket); bucket++);
+            cs->hist[bucket]++;
+        }
+        if (out != NULL) {
+            add_usage(out, &u);
+        }
+        return;
+    }
+}
+
+// Wait for a foreground child and account its usage into out (may be NULL)
+static void wait_child(pid_t pid, Usage *out) {
+    struct rusage ru;
+    int status;
+    if (wait4(pid, &status, 0, &ru) == pid) {
+        lastStatus = status;
+        block_sigchld(); // The handler updates the same stats for background children
+        record_exit(pid, &ru, out);
+        unblock_sigchld();
+    }
+}
 
 // Function to handle SIGCHLD and reap zombie processes
 void sigchld_handler(int sig) {
-    // Use a loop to ensure that we reap all terminated child processes
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    int savedErrno = errno;
+    struct rusage ru;
+    // Only reap background children: foreground ones are reaped (and timed) by wait_child,
+    // and every background child is tracked since launch fails when the table is full
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        if (tracked[i].pid != 0 && tracked[i].background &&
+            wait4(tracked[i].pid, NULL, WNOHANG, &ru) > 0) {
+            record_exit(tracked[i].pid, &ru, NULL);
+        }
+    }
+    errno = savedErrno;
+}
+
+// Print the per-command stats table and wall time histograms (the "stats" builtin)
+static void print_stats(void) {
+    block_sigchld();
+    printf("%-20s %8s %12s %12s %12s %10s %10s\n",
+           "command", "runs", "avg wall", "avg user", "avg sys", "max rss", "avg csw");
+    for (int i = 0; i < commandCount; i++) {
+        CommandStats *cs = &commandStats[i];
+        if (cs->runs == 0) {
+            continue;
+        }
+        printf("%-20s %8lu %11.3fms %11.3fms %11.3fms %8ldKB %10.1f\n",
+               cs->name, cs->runs,
+               cs->total.wall * 1e3 / cs->runs,
+               cs->total.user * 1e3 / cs->runs,
+               cs->total.sys * 1e3 / cs->runs,
+               cs->total.maxrss,
+               (double) cs->total.csw / cs->runs);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (cs->hist[b] == 0) {
+                continue;
+            }
+            // Bucket 0 also holds sub-microsecond runs, the last bucket holds everything slower
+            printf("    %10ldus - %10ldus %8lu %5.1f%%\n",
+                   b == 0 ? 0L : 1L << b, 2L << b, cs->hist[b], 100.0 * cs->hist[b] / cs->runs);
+        }
+    }
+    unblock_sigchld();
+}
+
+// A connection in server mode. Its socket is non-blocking: replies are queued in out and sent as
+// the client reads them, so a client that stops reading doesn't stall the others
+typedef struct {
+    int fd;                     // -1 if the slot is free
+    char in[SERVE_LINE_MAX];    // Bytes received but not yet split into command lines
+    size_t inLen;
+    int discarding;             // Skipping the rest of an overlong line up to its newline
+    unsigned long nextSeq;      // Sequence number given to the next command line
+    char *out;                  // Reply frames queued for the client, out[outHead..outLen) not sent yet
+    size_t outHead, outLen, outCap;
+    int broken;                 // Sending failed or a reply couldn't be queued; drop the client
+} ServeClient;
+
+// A command line executing in a worker in server mode
+typedef struct {
+    pid_t pid;                  // 0 if the slot is free
+    int out;                    // Read end of the worker's stdout/stderr pipe
+    int client;                 // Index into the clients array, -1 if the client went away
+    unsigned long seq;
+    char *buf;                  // Output captured so far
+    size_t len, cap;
+} ServeRequest;
+
+// Append bytes to a client's reply queue
+static void queue_bytes(ServeClient *cl, const char *buf, size_t len) {
+    if (cl->broken || len == 0) {
+        return;
+    }
+    if (cl->outLen + len > cl->outCap && cl->outHead > 0) {
+        memmove(cl->out, cl->out + cl->outHead, cl->outLen - cl->outHead); // Reuse the sent prefix
+        cl->outLen -= cl->outHead;
+        cl->outHead = 0;
+    }
+    if (cl->outLen + len > cl->outCap) {
+        char *grown;
+        size_t cap = cl->outCap ? cl->outCap * 2 : 4096;
+        while (cap < cl->outLen + len) cap *= 2;
+        if ((grown = realloc(cl->out, cap)) == NULL) {
+            cl->broken = 1; // Losing a frame would desynchronize the client
+            return;
+        }
+        cl->out = grown;
+        cl->outCap = cap;
+    }
+    memcpy(cl->out + cl->outLen, buf, len);
+    cl->outLen += len;
+}
+
+// Queue one response frame: "<seq> <status> <length>\n" followed by length bytes of output.
+// status is the exit code, or 128 + signal number if the command was killed
+static void send_frame(ServeClient *cl, unsigned long seq, int status, const char *out, size_t len) {
+    char header[64];
+    int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    int n = snprintf(header, sizeof(header), "%lu %d %zu\n", seq, code, len);
+    queue_bytes(cl, header, n);
+    queue_bytes(cl, out, len);
+}
+
+// Send as much of a client's reply queue as its socket takes without blocking. MSG_NOSIGNAL
+// turns a client that already went away into EPIPE instead of a SIGPIPE killing the shell
+static void flush_client(ServeClient *cl) {
+    ssize_t n;
+    while (!cl->broken && cl->outHead < cl->outLen) {
+        if ((n = send(cl->fd, cl->out + cl->outHead, cl->outLen - cl->outHead, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) cl->broken = 1;
+            return;
+        }
+        cl->outHead += n;
+    }
+    cl->outHead = cl->outLen = 0;
+}
+
+// Body of a worker process: run one command line with output going to out, exit with its status
+static void serve_worker(char *line, int out) {
+    char *arglist[SERVE_LINE_MAX / 2 + 1];
+    int count = 0;
+    int devnull = open("/dev/null", O_RDONLY);
+
+    dup2(devnull, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    close(devnull);
+    close(out);
+
+    for (char *tok = strtok(line, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n")) {
+        arglist[count++] = tok;
+    }
+    arglist[count] = NULL;
+    lastStatus = 0;
+    if (count > 0) {
+        process_arglist(count, arglist);
+    }
+    fflush(stdout);
+    _exit(WIFSIGNALED(lastStatus) ? 128 + WTERMSIG(lastStatus) : WEXITSTATUS(lastStatus));
+}
+
+// Start a worker for one command line. Returns 0 on success, -1 if the worker couldn't be started
+static int serve_start(ServeRequest *req, char *line, int client, unsigned long seq) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    prime_glob_cache(line); // The worker's own cache is thrown away when it exits
+    fflush(NULL); // Don't let the worker inherit (and later flush) our buffered output
+    req->pid = fork();
+    if (req->pid == -1) {
+        req->pid = 0;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (req->pid == 0) {
+        close(pipefd[0]);
+        serve_worker(line, pipefd[1]);
+    }
+    close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    req->out = pipefd[0];
+    req->client = client;
+    req->seq = seq;
+    req->buf = NULL;
+    req->len = req->cap = 0;
+    return 0;
+}
+
+// Collect output from a worker. When its output is closed, reap it and answer the client
+static void serve_collect(ServeRequest *req, ServeClient *clients) {
+    char chunk[4096];
+    ssize_t n;
+    int status;
+
+    while ((n = read(req->out, chunk, sizeof(chunk))) > 0) {
+        if (req->len + n > req->cap) {
+            char *grown;
+            size_t cap = req->cap ? req->cap * 2 : sizeof(chunk);
+            while (cap < req->len + n) cap *= 2;
+            if ((grown = realloc(req->buf, cap)) == NULL) {
+                continue; // Drop output we can't store, keep draining the worker
+            }
+            req->buf = grown;
+            req->cap = cap;
+        }
+        memcpy(req->buf + req->len, chunk, n);
+        req->len += n;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return; // More output to come
+    }
+
+    waitpid(req->pid, &status, 0);
+    if (req->client != -1) {
+        send_frame(&clients[req->client], req->seq, status, req->buf, req->len);
+    }
+    close(req->out);
+    free(req->buf);
+    req->pid = 0;
+}
+
+// Split complete lines out of a client's input buffer and start a worker for each.
+// Lines that don't fit in a free request slot stay buffered until one frees up.
+// Returns 1 if the client asked the server to shut down
+static int serve_dispatch(ServeClient *clients, int c, ServeRequest *requests, int *running) {
+    ServeClient *cl = &clients[c];
+    char *nl;
+    size_t used = 0;
+
+    while ((nl = memchr(cl->in + used, '\n', cl->inLen - used)) != NULL) {
+        int r;
+        for (r = 0; r < SERVE_MAX_REQUESTS && requests[r].pid != 0; r++);
+        if (r == SERVE_MAX_REQUESTS) {
+            break;
+        }
+        *nl = '\0';
+        if (strcmp(cl->in + used, "shutdown") == 0) {
+            cl->inLen = 0;
+            return 1;
+        }
+        if (serve_start(&requests[r], cl->in + used, c, cl->nextSeq) == 0) {
+            (*running)++;
+        } else {
+            send_frame(cl, cl->nextSeq, 127 << 8, NULL, 0);
+        }
+        cl->nextSeq++;
+        used = nl + 1 - cl->in;
+    }
+    memmove(cl->in, cl->in + used, cl->inLen - used);
+    cl->inLen -= used;
+    return 0;
+}
+
+// Close a client's connection. Its running commands finish but their output is dropped
+static void serve_drop(ServeClient *clients, int c, ServeRequest *requests) {
+    for (int r = 0; r < SERVE_MAX_REQUESTS; r++) {
+        if (requests[r].pid != 0 && requests[r].client == c) {
+            requests[r].client = -1;
+        }
+    }
+    close(clients[c].fd);
+    free(clients[c].out);
+    clients[c].fd = -1;
+    clients[c].out = NULL;
+}
+
+// Read from a client and dispatch the complete lines it sent. A line that doesn't fit in the input
+// buffer gets an error frame instead of running, and the rest of it is skipped.
+// Returns 1 if the client asked the server to shut down
+static int serve_read(ServeClient *clients, int c, ServeRequest *requests, int *running) {
+    static const char tooLong[] = "serve: command line too long\n";
+    ServeClient *cl = &clients[c];
+    ssize_t n = read(cl->fd, cl->in + cl->inLen, sizeof(cl->in) - cl->inLen);
+    char *nl;
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        serve_drop(clients, c, requests);
+        return 0;
+    }
+    if (cl->discarding) { // inLen is 0 while discarding
+        if ((nl = memchr(cl->in, '\n', n)) == NULL) {
+            return 0;
+        }
+        n -= nl + 1 - cl->in;
+        memmove(cl->in, nl + 1, n);
+        cl->discarding = 0;
+    }
+    cl->inLen += n;
+    if (cl->inLen == sizeof(cl->in) && memchr(cl->in, '\n', cl->inLen) == NULL) {
+        send_frame(cl, cl->nextSeq++, 2 << 8, tooLong, sizeof(tooLong) - 1);
+        cl->inLen = 0;
+        cl->discarding = 1;
+        return 0;
+    }
+    return serve_dispatch(clients, c, requests, running);
+}
+
+// The "serve PATH" builtin: accept command lines on a Unix domain socket and run them concurrently.
+// Each line gets one response frame (see send_frame) carrying its sequence number on the connection,
+// since commands finish out of order. A line reading "shutdown" stops the server once the running
+// commands are done and their replies are sent
+static void serve(const char *path) {
+    static ServeClient clients[SERVE_MAX_CLIENTS];
+    static ServeRequest requests[SERVE_MAX_REQUESTS];
+    struct pollfd fds[1 + SERVE_MAX_CLIENTS + SERVE_MAX_REQUESTS];
+    int owner[1 + SERVE_MAX_CLIENTS + SERVE_MAX_REQUESTS]; // Client index, or -(request index) - 1
+    struct sockaddr_un addr;
+    int listener, running = 0, stop = 0, pending = 0;
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("socket");
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, SOMAXCONN) == -1) {
+        perror("bind");
+        close(listener);
+        return;
+    }
+    for (int c = 0; c < SERVE_MAX_CLIENTS; c++) {
+        clients[c].fd = -1;
+    }
+
+    while (!stop || running > 0 || pending) {
+        int nfds = 0;
+        if (!stop) {
+            fds[nfds].fd = listener;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = SERVE_MAX_CLIENTS; // Marks the listener
+        }
+        for (int c = 0; c < SERVE_MAX_CLIENTS; c++) {
+            if (clients[c].fd == -1) {
+                continue;
+            }
+            // Stop reading from clients while every request slot is busy. Clients are polled
+            // regardless, so one that hangs up is noticed (POLLHUP) and dropped
+            fds[nfds].fd = clients[c].fd;
+            fds[nfds].events = 0;
+            if (!stop && running < SERVE_MAX_REQUESTS && clients[c].inLen < sizeof(clients[c].in)) {
+                fds[nfds].events |= POLLIN;
+            }
+            if (clients[c].outLen > 0) {
+                fds[nfds].events |= POLLOUT;
+            }
+            owner[nfds++] = c;
+        }
+        for (int r = 0; r < SERVE_MAX_REQUESTS; r++) {
+            if (requests[r].pid != 0) {
+                fds[nfds].fd = requests[r].out;
+                fds[nfds].events = POLLIN;
+                owner[nfds++] = -r - 1;
+            }
+        }
+
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (owner[i] == SERVE_MAX_CLIENTS) {
+                int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                int c;
+                for (c = 0; c < SERVE_MAX_CLIENTS && clients[c].fd != -1; c++);
+                if (fd != -1 && c == SERVE_MAX_CLIENTS) {
+                    close(fd); // Too many clients
+                } else if (fd != -1) {
+                    memset(&clients[c], 0, sizeof(ServeClient));
+                    clients[c].fd = fd;
+                }
+            } else if (owner[i] >= 0) {
+                if (clients[owner[i]].fd == -1) {
+                    continue;
+                }
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue; // POLLOUT: the client's replies are flushed below
+                }
+                if (fds[i].events & POLLIN) {
+                    // A hangup is seen by read, after any lines still buffered in the socket
+                    stop |= serve_read(clients, owner[i], requests, &running);
+                } else {
+                    serve_drop(clients, owner[i], requests);
+                }
+            } else {
+                ServeRequest *req = &requests[-owner[i] - 1];
+                serve_collect(req, clients);
+                if (req->pid == 0) {
+                    running--;
+                }
+            }
+        }
+        // Lines may have been held back while every request slot was busy
+        for (int c = 0; c < SERVE_MAX_CLIENTS && !stop; c++) {
+            if (clients[c].fd != -1 && clients[c].inLen > 0) {
+                stop = serve_dispatch(clients, c, requests, &running);
+            }
+        }
+        pending = 0;
+        for (int c = 0; c < SERVE_MAX_CLIENTS; c++) {
+            if (clients[c].fd == -1) {
+                continue;
+            }
+            flush_client(&clients[c]);
+            if (clients[c].broken) {
+                serve_drop(clients, c, requests);
+            } else if (clients[c].outLen > 0) {
+                pending = 1;
+            }
+        }
+    }
+
+    for (int c = 0; c < SERVE_MAX_CLIENTS; c++) {
+        if (clients[c].fd != -1) {
+            serve_drop(clients, c, requests);
+        }
+    }
+    close(listener);
+    unlink(path);
+}
+
+// Move everything from in to out for an in-shell file stage, keeping the data in the kernel when
+// possible: copy_file_range between regular files, splice when either end is a pipe, and plain
+// read/write when neither applies (e.g. splice into an O_APPEND file). Returns 0 or -1 with errno set;
+// errno is EINTR if SIGINT stopped the copy, which the shell would otherwise never see
+static int move_data(int in, int out) {
+    char buf[65536];
+    ssize_t n, w;
+    int method = 0; // 0 = copy_file_range, 1 = splice, 2 = read/write
+
+    while (1) {
+        if (interrupted) {
+            errno = EINTR;
+            return -1;
+        }
+        if (method == 0) {
+            n = copy_file_range(in, NULL, out, NULL, MOVE_CHUNK, 0);
+        } else if (method == 1) {
+            n = splice(in, NULL, out, NULL, MOVE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = read(in, buf, sizeof(buf));
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue; // Checked against interrupted at the top
+            if (method < 2 && (errno == EINVAL || errno == EXDEV || errno == EBADF || errno == ENOSYS ||
+                               errno == EOPNOTSUPP)) {
+                method++; // This pair of fds doesn't support the method, nothing was moved yet
+                continue;
+            }
+            return -1;
+        }
+        if (method == 2) {
+            for (char *p = buf; n > 0; p += w, n -= w) {
+                if ((w = write(out, p, n)) < 0) {
+                    if (errno == EINTR && !interrupted) { w = 0; continue; }
+                    return -1;
+                }
+            }
+        }
+    }
+}
+
+// Copy the files named by a "cat FILE..." stage into out, reporting failures the way cat does.
+// A file that is also the output is skipped, as copying it into itself would never end
+static void cat_files(char **files, int nfiles, int out) {
+    struct stat outSt, inSt;
+    int outIsFile = fstat(out, &outSt) == 0 && S_ISREG(outSt.st_mode);
+
+    for (int i = 0; i < nfiles; i++) {
+        int fd = open(files[i], O_RDONLY);
+        int failed;
+        if (fd != -1 && outIsFile && fstat(fd, &inSt) == 0 &&
+            inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", files[i]);
+            lastStatus = 1 << 8;
+            close(fd);
+            continue;
+        }
+        failed = fd == -1 || move_data(fd, out) == -1;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (failed && errno == EPIPE) {
+            return; // The reader went away; an external cat would have died of SIGPIPE quietly
+        }
+        if (failed && errno == EINTR) {
+            lastStatus = SIGINT; // Report it the way a cat killed by SIGINT would be
+            return;
+        }
+        if (failed) {
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+            lastStatus = 1 << 8;
+        }
+    }
+}
+
+// Is arglist[from..to) a plain "cat FILE..." stage (at least one file, no options or redirections)?
+static int is_cat_source(char **arglist, int from, int to) {
+    if (to - from < 2 || strcmp(arglist[from], "cat") != 0) {
+        return 0;
+    }
+    for (int i = from + 1; i < to; i++) {
+        if (arglist[i][0] == '-' || strcmp(arglist[i], "<") == 0 ||
+            strcmp(arglist[i], ">") == 0 || strcmp(arglist[i], ">>") == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run "cat FILE... | cmd" and "cmd | cat > FILE" (or >>) with the cat stage executed by the shell
+// itself, saving a fork and an extra user-space copy per byte. Called with SIGCHLD blocked; returns 0
+// without side effects if the pipeline has no such stage
+static int run_file_stages(int count, char **arglist, int pipe_index, Usage *usage) {
+    int source = is_cat_source(arglist, 0, pipe_index);
+    int sink = count == pipe_index + 4 && strcmp(arglist[pipe_index + 1], "cat") == 0 &&
+               (strcmp(arglist[pipe_index + 2], ">") == 0 || strcmp(arglist[pipe_index + 2], ">>") == 0);
+    int append = sink && strcmp(arglist[pipe_index + 2], ">>") == 0;
+    int pipefd[2], out = -1;
+    struct sigaction ignore, oldPipe;
+    pid_t pid;
+
+    if (!source && !sink) {
+        return 0;
+    }
+    if (sink) {
+        out = open(arglist[pipe_index + 3], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (out == -1) {
+            perror("open");
+            unblock_sigchld();
+            return 1;
+        }
+    }
+    lastStatus = 0;
+    interrupted = 0;
+
+    if (source && sink) {
+        // Both stages are in-shell: copy file to file without any process or pipe
+        unblock_sigchld();
+        cat_files(arglist + 1, pipe_index - 1, out);
+        close(out);
+        return 1;
+    }
+
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        if (out != -1) close(out);
+        unblock_sigchld();
+        return 1;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (out != -1) close(out);
+        unblock_sigchld();
+        return 1;
+    }
+    if (pid == 0) { // The external stage
+        unblock_sigchld();
+        if (source) {
+            dup2(pipefd[0], STDIN_FILENO);
+            arglist += pipe_index + 1;
+        } else {
+            dup2(pipefd[1], STDOUT_FILENO);
+            close(out);
+            arglist[pipe_index] = NULL;
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (execvp(arglist[0], arglist) == -1) {
+            perror("execvp");
+            exit(1);
+        }
+    }
+    track_child(pid, source ? arglist[pipe_index + 1] : arglist[0], 0);
+    unblock_sigchld();
+
+    if (source) {
+        // A reader that exits early must not kill the shell with SIGPIPE. The child was forked
+        // before this, so it keeps the default disposition
+        close(pipefd[0]);
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+        ignore.sa_flags = 0;
+        sigaction(SIGPIPE, &ignore, &oldPipe);
+        cat_files(arglist + 1, pipe_index - 1, pipefd[1]);
+        close(pipefd[1]);
+        sigaction(SIGPIPE, &oldPipe, NULL);
+        wait_child(pid, usage);
+    } else {
+        close(pipefd[1]);
+        if (move_data(pipefd[0], out) == -1 && errno != EINTR) {
+            perror("cat");
+        }
+        close(pipefd[0]);
+        close(out);
+        wait_child(pid, usage);
+    }
+    return 1;
+}
+
+// A cached directory listing used by glob expansion. It stays valid while the directory's
+// mtime is unchanged, so repeated globs over a large directory don't re-read it
+typedef struct {
+    char *path;                 // NULL if the slot is free
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t scanned;             // Wall clock time the listing was read
+    char **names;               // Entry names sorted with strcmp
+    size_t count;
+    char *pool;                 // Storage for the names
+    unsigned long lastUse;      // For evicting the least recently used listing
+} DirListing;
+
+// A growing NULL-terminated argument vector whose strings are all owned (malloc'd)
+typedef struct {
+    char **items;
+    int count, cap;
+} ArgVector;
+
+static DirListing dirCache[GLOB_CACHE_DIRS];
+static unsigned long dirCacheClock = 0;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void free_listing(DirListing *dl) {
+    free(dl->path);
+    free(dl->names);
+    free(dl->pool);
+    dl->path = NULL;
+}
+
+// Read a directory into dl. Returns 0 on success, -1 if it can't be read
+static int scan_listing(DirListing *dl, const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    size_t poolLen = 0, poolCap = 4096, count = 0, *offsets = NULL, offsetsCap = 0;
+    char *pool;
+
+    if (dir == NULL || (pool = malloc(poolCap)) == NULL) {
+        if (dir != NULL) closedir(dir);
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name) + 1;
+        if (poolLen + len > poolCap) {
+            while (poolLen + len > poolCap) poolCap *= 2;
+            pool = realloc(pool, poolCap);
+        }
+        if (count == offsetsCap) {
+            offsetsCap = offsetsCap ? offsetsCap * 2 : 256;
+            offsets = realloc(offsets, offsetsCap * sizeof(size_t));
+        }
+        if (pool == NULL || offsets == NULL) {
+            printf("realloc failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        memcpy(pool + poolLen, ent->d_name, len);
+        offsets[count++] = poolLen;
+        poolLen += len;
+    }
+    closedir(dir);
+
+    // The pool has stopped moving, so offsets can become pointers now
+    if ((dl->names = malloc((count ? count : 1) * sizeof(char *))) == NULL) {
+        printf("malloc failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        dl->names[i] = pool + offsets[i];
+    }
+    free(offsets);
+    qsort(dl->names, count, sizeof(char *), compare_names);
+    dl->pool = pool;
+    dl->count = count;
+    dl->path = strdup(path);
+    return 0;
+}
+
+// Return the listing of a directory, from the cache when the directory hasn't changed since it was read.
+// A listing read less than a second after the directory's last change isn't trusted: a later change in
+// the same timestamp tick would leave the mtime unchanged
+static DirListing *get_listing(const char *path) {
+    struct stat st;
+    DirListing *dl = NULL, *victim = &dirCache[0];
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        if (dirCache[i].path != NULL && strcmp(dirCache[i].path, path) == 0) {
+            dl = &dirCache[i];
+            break;
+        }
+        if (dirCache[i].path == NULL) {
+            victim = &dirCache[i];
+        } else if (victim->path != NULL && dirCache[i].lastUse < victim->lastUse) {
+            victim = &dirCache[i];
+        }
+    }
+    if (dl != NULL && dl->dev == st.st_dev && dl->ino == st.st_ino &&
+        dl->mtime.tv_sec == st.st_mtim.tv_sec && dl->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        dl->scanned > st.st_mtim.tv_sec) {
+        dl->lastUse = ++dirCacheClock;
+        return dl;
+    }
+
+    if (dl == NULL) {
+        dl = victim;
+    }
+    if (dl->path != NULL) {
+        free_listing(dl);
+    }
+    // Taken before reading: a change made while we read must not look older than the listing
+    dl->scanned = time(NULL);
+    if (scan_listing(dl, path) == -1) {
+        return NULL;
+    }
+    dl->dev = st.st_dev;
+    dl->ino = st.st_ino;
+    dl->mtime = st.st_mtim;
+    dl->lastUse = ++dirCacheClock;
+    return dl;
+}
+
+static void push_arg(ArgVector *av, const char *arg) {
+    if (av->count + 1 >= av->cap) {
+        av->cap = av->cap ? av->cap * 2 : 16;
+        if ((av->items = realloc(av->items, av->cap * sizeof(char *))) == NULL) {
+            printf("realloc failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    if ((av->items[av->count++] = strdup(arg)) == NULL) {
+        printf("strdup failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    av->items[av->count] = NULL;
+}
+
+static int has_glob(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Expand the remaining path components in rest onto path (of length len), pushing every match.
+// afterGlob is set once a component was matched, so later literal components must be checked to exist
+static void glob_walk(char *path, size_t len, const char *rest, int afterGlob, ArgVector *out) {
+    const char *slash = strchr(rest, '/');
+    size_t compLen = slash ? (size_t) (slash - rest) : strlen(rest);
+    size_t sepLen = slash ? 1 : 0;
+    char pattern[NAME_MAX + 1];
+    struct stat st;
+    DirListing *dl;
+    size_t prefixLen, lo, hi;
+
+    if (*rest == '\0') {
+        if (!afterGlob || lstat(path, &st) == 0) {
+            push_arg(out, path);
+        }
+        return;
+    }
+    if (!has_glob(rest, compLen)) {
+        if (len + compLen + sepLen >= PATH_MAX) return;
+        memcpy(path + len, rest, compLen + sepLen);
+        path[len + compLen + sepLen] = '\0';
+        glob_walk(path, len + compLen + sepLen, rest + compLen + sepLen, afterGlob, out);
+        return;
+    }
+    if (compLen > NAME_MAX || (dl = get_listing(len ? path : ".")) == NULL) {
+        return;
+    }
+    memcpy(pattern, rest, compLen);
+    pattern[compLen] = '\0';
+
+    // Names are sorted, so only the range sharing the pattern's literal prefix needs matching
+    for (prefixLen = 0; prefixLen < compLen && !has_glob(pattern + prefixLen, 1) &&
+                        pattern[prefixLen] != '\\'; prefixLen++);
+    for (lo = 0, hi = dl->count; lo < hi;) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(dl->names[mid], pattern, prefixLen) < 0) lo = mid + 1; else hi = mid;
+    }
+    for (size_t i = lo; i < dl->count && strncmp(dl->names[i], pattern, prefixLen) == 0; i++) {
+        const char *name = dl->names[i];
+        size_t nameLen = strlen(name);
+        if (fnmatch(pattern, name, FNM_PERIOD) != 0 || len + nameLen + sepLen >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + len, name, nameLen);
+        memcpy(path + len + nameLen, rest + compLen, sepLen);
+        path[len + nameLen + sepLen] = '\0';
+        glob_walk(path, len + nameLen + sepLen, rest + compLen + sepLen, 1, out);
+    }
+    path[len] = '\0';
+}
+
+// Expand *, ? and [...] in every argument. An argument matching nothing is kept as typed
+static void expand_globs(int count, char **arglist, ArgVector *out) {
+    char path[PATH_MAX];
+    for (int i = 0; i < count; i++) {
+        int before = out->count;
+        if (has_glob(arglist[i], strlen(arglist[i]))) {
+            path[0] = '\0';
+            glob_walk(path, 0, arglist[i], 0, out);
+        }
+        if (out->count == before) {
+            push_arg(out, arglist[i]);
+        }
+    }
+}
+
+// Read the directory listings a command line's globs need into the cache. serve calls this before
+// forking each worker, so the listings are kept in the server and reused by later requests
+static void prime_glob_cache(const char *line) {
+    char copy[SERVE_LINE_MAX];
+    char *arglist[SERVE_LINE_MAX / 2 + 1];
+    ArgVector expanded = {NULL, 0, 0};
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", line);
+    for (char *tok = strtok(copy, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n")) {
+        if (has_glob(tok, strlen(tok))) {
+            arglist[count++] = tok;
+        }
+    }
+    expand_globs(count, arglist, &expanded);
+    for (int i = 0; i < expanded.count; i++) {
+        free(expanded.items[i]);
+    }
+    free(expanded.items);
 }
 
 // Function to handle SIGINT in the shell
 void sigint_handler(int sig) {
-    // Do nothing, just return to prevent the shell from exiting on SIGINT
+    // Don't exit, just stop an in-shell file stage if one is running
+    interrupted = 1;
 }
 
 // Prepare function for initialization
@@ -44,15 +1045,50 @@ int prepare(void) {
     return 0;
 }
 
-// Process the command line arguments
-int process_arglist(int count, char **arglist) {
+// Run one expanded command line
+static int run_arglist(int count, char **arglist) {
     pid_t pid;
-    int status;
     int bg_process = 0;
     int pipe_index = -1;
     int input_redirect_index = -1;
     int output_redirect_index = -1;
     int output_append_index = -1;
+    int timed = 0;
+    Usage usage = {0};
+    struct timespec begin, end;
+
+    // Builtin: print per-command resource usage, or clear it with "stats reset"
+    if (strcmp(arglist[0], "stats") == 0) {
+        if (count > 1 && strcmp(arglist[1], "reset") == 0) {
+            block_sigchld();
+            commandCount = 0;
+            for (int i = 0; i < MAX_TRACKED; i++) {
+                tracked[i].cmd = -1; // Children still running were accounted to the old table
+            }
+            unblock_sigchld();
+        } else {
+            print_stats();
+        }
+        return 1;
+    }
+
+    // Builtin: run as a command server on a Unix domain socket until a client sends "shutdown"
+    if (strcmp(arglist[0], "serve") == 0) {
+        if (count != 2) {
+            fprintf(stderr, "usage: serve SOCKET_PATH\n");
+        } else {
+            serve(arglist[1]);
+        }
+        return 1;
+    }
+
+    // Prefix: "time cmd ..." reports the usage of cmd once it finishes
+    if (strcmp(arglist[0], "time") == 0 && count > 1) {
+        timed = 1;
+        arglist++;
+        count--;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+    }
 
     // Check for background process
     if (count > 0 && strcmp(arglist[count - 1], "&") == 0) {
@@ -74,21 +1110,31 @@ int process_arglist(int count, char **arglist) {
         }
     }
 
-    if (pipe_index != -1) {
+    // Keep SIGCHLD blocked until the children are tracked, so a background child that
+    // exits immediately is still accounted by the handler
+    block_sigchld();
+
+    if (pipe_index != -1 && run_file_stages(count, arglist, pipe_index, &usage)) {
+        // Pipeline with an in-shell "cat" source or sink stage, already run
+
+    } else if (pipe_index != -1) {
         // Handle piping
         int pipefd[2];
         if (pipe(pipefd) == -1) {
             perror("pipe");
+            unblock_sigchld();
             return 0;
         }
 
         pid_t pid1 = fork();
         if (pid1 == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid1 == 0) { // Child process 1
+            unblock_sigchld();
             close(pipefd[0]); // Close unused read end
             dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe
             close(pipefd[1]);
@@ -100,13 +1146,17 @@ int process_arglist(int count, char **arglist) {
             }
         }
 
+        track_child(pid1, arglist[0], 0);
+
         pid_t pid2 = fork();
         if (pid2 == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid2 == 0) { // Child process 2
+            unblock_sigchld();
             close(pipefd[1]); // Close unused write end
             dup2(pipefd[0], STDIN_FILENO); // Redirect stdin from pipe
             close(pipefd[0]);
@@ -118,22 +1168,26 @@ int process_arglist(int count, char **arglist) {
         }
 
         // Parent process
+        track_child(pid2, arglist[pipe_index + 1], 0);
+        unblock_sigchld();
         close(pipefd[0]);
         close(pipefd[1]);
 
         // Wait for both children to finish
-        waitpid(pid1, &status, 0);
-        waitpid(pid2, &status, 0);
+        wait_child(pid1, &usage);
+        wait_child(pid2, &usage);
 
     } else if (input_redirect_index != -1) {
         // Handle input redirection
         pid = fork();
         if (pid == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid == 0) { // Child process
+            unblock_sigchld();
             int fd = open(arglist[input_redirect_index + 1], O_RDONLY);
             if (fd == -1) {
                 perror("open");
@@ -148,7 +1202,9 @@ int process_arglist(int count, char **arglist) {
                 exit(1);
             }
         } else { // Parent process
-            waitpid(pid, &status, 0);
+            track_child(pid, arglist[0], 0);
+            unblock_sigchld();
+            wait_child(pid, &usage);
         }
 
     } else if (output_redirect_index != -1) {
@@ -156,10 +1212,12 @@ int process_arglist(int count, char **arglist) {
         pid = fork();
         if (pid == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid == 0) { // Child process
+            unblock_sigchld();
             int fd = open(arglist[output_redirect_index + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
             if (fd == -1) {
                 perror("open");
@@ -174,7 +1232,9 @@ int process_arglist(int count, char **arglist) {
                 exit(1);
             }
         } else { // Parent process
-            waitpid(pid, &status, 0);
+            track_child(pid, arglist[0], 0);
+            unblock_sigchld();
+            wait_child(pid, &usage);
         }
 
     } else if (output_append_index != -1) {
@@ -182,10 +1242,12 @@ int process_arglist(int count, char **arglist) {
         pid = fork();
         if (pid == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid == 0) { // Child process
+            unblock_sigchld();
             int fd = open(arglist[output_append_index + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
             if (fd == -1) {
                 perror("open");
@@ -200,25 +1262,36 @@ int process_arglist(int count, char **arglist) {
                 exit(1);
             }
         } else { // Parent process
-            waitpid(pid, &status, 0);
+            track_child(pid, arglist[0], 0);
+            unblock_sigchld();
+            wait_child(pid, &usage);
         }
 
     } else {
         // Handle regular commands and background processes
+        if (bg_process && free_slot() == -1) {
+            fprintf(stderr, "too many background processes\n");
+            unblock_sigchld();
+            return 1;
+        }
         pid = fork();
         if (pid == -1) {
             perror("fork");
+            unblock_sigchld();
             return 0;
         }
 
         if (pid == 0) { // Child process
+            unblock_sigchld();
             if (execvp(arglist[0], arglist) == -1) {
                 perror("execvp");
                 exit(1);
             }
         } else { // Parent process
+            track_child(pid, arglist[0], bg_process);
+            unblock_sigchld();
             if (!bg_process) {
-                waitpid(pid, &status, 0);
+                wait_child(pid, &usage);
             } else {
                 // Don't wait for background process
                 printf("Started background process with PID %d\n", pid);
@@ -226,9 +1299,37 @@ int process_arglist(int count, char **arglist) {
         }
     }
 
+    if (timed && !bg_process) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "real %.6fs  user %.6fs  sys %.6fs  maxrss %ldKB  csw %ld\n",
+                elapsed(&begin, &end), usage.user, usage.sys, usage.maxrss, usage.csw);
+    }
+
     return 1;
 }
 
+// Process the command line arguments
+int process_arglist(int count, char **arglist) {
+    ArgVector expanded = {NULL, 0, 0};
+    char **owned;
+    int result;
+
+    expand_globs(count, arglist, &expanded);
+    // run_arglist overwrites entries (e.g. "&" and "|" become NULL), so free through a copy
+    if ((owned = malloc(expanded.count * sizeof(char *))) == NULL) {
+        printf("malloc failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(owned, expanded.items, expanded.count * sizeof(char *));
+    result = run_arglist(expanded.count, expanded.items);
+    for (int i = 0; i < expanded.count; i++) {
+        free(owned[i]);
+    }
+    free(owned);
+    free(expanded.items);
+    return result;
+}
+
 // Finalize function for cleanup
 int finalize(void) {
     return 0;
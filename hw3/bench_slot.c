@@ -0,0 +1,162 @@
+// Multithreaded benchmark of the message_slot channel store, built in user space (no module needed):
+//   make bench_slot
+//   ./bench_slot [-t THREADS,...] [-c CHANNELS,...] [-s SECONDS] [-w WRITE_PERCENT]
+// Every combination of thread count and channel count runs for the given time against a fresh
+// table, with each thread picking a random channel per operation. One line is printed per run.
+#define MSG_SLOT_USER
+#include "message_slot.c"
+
+#include <stdio.h>       // For printf and fprintf
+#include <unistd.h>      // For getopt and sysconf
+
+#define MAX_RUNS 32      // Maximum number of values in a -t or -c list
+
+typedef struct _Worker {
+    pthread_t thread;          // Thread running the worker
+    unsigned long long seed;   // State of the worker's xorshift generator
+    unsigned long reads;       // Successful reads
+    unsigned long writes;      // Successful writes
+    unsigned long misses;      // Reads that found no message
+} __attribute__((aligned(64))) Worker; // Counters of different workers on different cache lines
+
+static ChannelTable *table;         // Table of the current run
+static unsigned long channels;      // Channels of the current run, IDs 1 to channels
+static int writePercent = 10;       // Share of operations that are writes
+static volatile int stop;           // Set when the current run's time is up
+static pthread_barrier_t start;     // Lets all workers and the timer start together
+
+// Function to get the next pseudo-random number of a worker
+static unsigned long long nextRandom(Worker *w) {
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return w->seed;
+}
+
+// Worker thread: random reads and writes until the run stops
+static void *work(void *arg) {
+    Worker *w = arg;
+    char msg[BUF_LEN], buffer[BUF_LEN];
+    unsigned long seen, channelId;
+    unsigned long long r;
+    struct iov_iter iter;
+    ssize_t status;
+    memset(msg, 'm', sizeof(msg));
+    pthread_barrier_wait(&start);
+    while (!stop) {
+        r = nextRandom(w);
+        channelId = 1 + (r >> 8) % channels;
+        if ((int) (r % 100) < writePercent) {
+            iov_iter_ubuf(&iter, ITER_SOURCE, msg, 1 + (r >> 40) % BUF_LEN);
+            status = channelWrite(table, channelId, &iter, true, false);
+            if (status > 0) w->writes++;
+        } else {
+            iov_iter_ubuf(&iter, ITER_DEST, buffer, sizeof(buffer));
+            status = channelRead(table, channelId, &iter, true, false, &seen);
+            if (status > 0) w->reads++;
+            else w->misses++;
+        }
+    }
+    return NULL;
+}
+
+// Function to run one combination and print its result line
+static int run(int threads, unsigned long channelCount, double seconds) {
+    Worker *workers;
+    struct timespec begin, end, pause;
+    unsigned long id, reads = 0, writes = 0, misses = 0;
+    struct iov_iter iter;
+    double elapsed;
+    int i;
+    table = createTable();
+    workers = aligned_alloc(64, threads * sizeof(Worker));
+    if (table == NULL || workers == NULL) {
+        fprintf(stderr, "Failed to allocate a run\n");
+        return -1;
+    }
+    channels = channelCount;
+    for (id = 1; id <= channels; id++) {
+        iov_iter_ubuf(&iter, ITER_SOURCE, "prefill", 7);
+        if (channelWrite(table, id, &iter, true, false) != 7) { // So reads find a message
+            fprintf(stderr, "Failed to create channel %lu (budget_kb too small?)\n", id);
+            return -1;
+        }
+    }
+    stop = 0;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(Worker));
+        workers[i].seed = 0x9E3779B97F4A7C15ull * (i + 1);
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pause.tv_sec = (time_t) seconds;
+    pause.tv_nsec = (long) ((seconds - pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+    stop = 1;
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        reads += workers[i].reads;
+        writes += workers[i].writes;
+        misses += workers[i].misses;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("%7d %9lu %14.0f %14.0f %14.0f %9lu\n", threads, channelCount, reads / elapsed,
+           writes / elapsed, (reads + writes) / elapsed, misses);
+    fflush(stdout);
+    pthread_barrier_destroy(&start);
+    free(workers);
+    srcu_barrier(&channelSrcu); // Run deferred frees before the table goes away
+    freeTable(table);
+    return 0;
+}
+
+// Function to parse a comma-separated list of positive numbers. Returns how many were parsed, 0 on error
+static int parseList(char *text, unsigned long *values) {
+    int n = 0;
+    char *token, *end;
+    for (token = strtok(text, ","); token != NULL && n < MAX_RUNS; token = strtok(NULL, ",")) {
+        values[n] = strtoul(token, &end, 10);
+        if (*end != '\0' || values[n] == 0) return 0;
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    unsigned long threads[MAX_RUNS], channelCounts[MAX_RUNS];
+    int threadRuns = 0, channelRuns = 4, opt, i, j;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 1;
+    channelCounts[0] = 1;
+    channelCounts[1] = 64;
+    channelCounts[2] = 4096;
+    channelCounts[3] = 65536;
+    for (i = 1; i <= cpus && threadRuns < MAX_RUNS; i *= 2) {
+        threads[threadRuns++] = i; // Default: powers of two up to the number of CPUs
+    }
+    while ((opt = getopt(argc, argv, "t:c:s:w:")) != -1) {
+        if (opt == 't' && (threadRuns = parseList(optarg, threads)) != 0) continue;
+        if (opt == 'c' && (channelRuns = parseList(optarg, channelCounts)) != 0) continue;
+        if (opt == 's' && (seconds = atof(optarg)) > 0) continue;
+        if (opt == 'w' && (writePercent = atoi(optarg)) >= 0 && writePercent <= 100) continue;
+        fprintf(stderr, "usage: %s [-t THREADS,...] [-c CHANNELS,...] [-s SECONDS] [-w WRITE_PERCENT]\n", argv[0]);
+        return 1;
+    }
+    if (storeInit() != SUCCESS) {
+        fprintf(stderr, "Failed to set up the channel store\n");
+        return 1;
+    }
+    printf("%7s %9s %14s %14s %14s %9s\n", "threads", "channels", "reads/s", "writes/s", "ops/s", "misses");
+    for (i = 0; i < channelRuns; i++) {
+        for (j = 0; j < threadRuns; j++) {
+            if (run((int) threads[j], channelCounts[i], seconds) != 0) {
+                return 1;
+            }
+        }
+    }
+    storeExit();
+    return 0;
+}
@@ -1,3 +1,7 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // For clock_gettime under -std=c11
+#endif
+
 #include <stdlib.h>      // For memory allocation, exit, etc.
 #include <stdio.h>       // For standard I/O functions like printf, perror
 #include <errno.h>       // For error number handling
@@ -5,8 +9,10 @@
 #include <limits.h>      // For defining data type limits, like UINT_MAX
 #include <fcntl.h>       // For file control options (open flags)
 #include <unistd.h>      // For standard symbolic constants and types, like STDOUT_FILENO
+#include <stdint.h>      // For uintptr_t
 #include <sys/ioctl.h>   // For ioctl system call
 #include "message_slot.h" // Include header for message slot ioctl definitions
+#include "message_stream.h" // For the streaming mode's options and statistics
 
 // Function to close the file descriptor
 void clean(int fd) {
@@ -19,11 +25,129 @@ void exitAndClean(int fd) {
     exit(errno); // Exit with the current error number
 }
 
+// Function to read n channels in one call. Statuses land in the entries
+void readMessages(int fd, const StreamOptions *opts, struct msg_slot_batch_entry *entries,
+                  unsigned int n, StreamStats *stats) {
+    struct msg_slot_batch batch;
+    double start = nowUs();
+    ssize_t retVal;
+    if (opts->batch == 1) {
+        if (ioctl(fd, MSG_SLOT_CHANNEL, (unsigned long) entries[0].channel_id) < 0) {
+            perror("ioctl failed");
+            exitAndClean(fd);
+        }
+        retVal = read(fd, (char *) (uintptr_t) entries[0].buffer, entries[0].length);
+        entries[0].status = retVal < 0 ? -errno : (int) retVal;
+    } else {
+        batch.op = MSG_SLOT_BATCH_READ;
+        batch.count = n;
+        batch.entries = (uintptr_t) entries;
+        if (ioctl(fd, MSG_SLOT_BATCH, &batch) < 0) {
+            perror("batch read failed");
+            exitAndClean(fd);
+        }
+    }
+    recordCall(stats, nowUs() - start);
+}
+
+// Function to run the streaming mode: read a channel range round-robin through a single non-blocking
+// file descriptor, writing the messages to stdout. Single-message channels keep their message, so by
+// default every channel is read once; with -d (queue-mode channels) reading goes on until a whole
+// pass over the range finds no message. -n stops earlier. Errors other than an empty channel are
+// reported and make the exit status 1
+int streamMain(int c, char **args) {
+    StreamOptions opts;
+    StreamStats stats = {0};
+    struct msg_slot_batch_entry *entries;
+    char *bufs;
+    unsigned long next = 0, emptyRun = 0, reads = 0, errors = 0;
+    unsigned int n, i, length;
+    int fd;
+
+    if (parseStreamOptions(c, args, &opts) != 0 || opts.file != NULL || opts.queueDepth != 0) {
+        fprintf(stderr, "usage: %s DEVICE --stream FIRST_CHANNEL COUNT [-l] [-b BATCH] [-n MESSAGES] [-d]\n"
+                        "  -l  prefix messages with a 4-byte length instead of ending them in a newline\n"
+                        "  -b  channels read per MSG_SLOT_BATCH call (1: ioctl and read per message)\n"
+                        "  -n  stop after this many messages\n"
+                        "  -d  drain queue-mode channels: read until a whole pass finds no message\n"
+                        "      (default: read every channel once)\n", args[0]);
+        exit(1);
+    }
+    fd = open(args[1], O_RDWR | O_NONBLOCK); // An empty channel is skipped, not waited for
+    if (fd < 0) {
+        perror("could not open file");
+        exit(1);
+    }
+    entries = calloc(opts.batch, sizeof(*entries));
+    bufs = malloc((size_t) opts.batch * BUF_LEN);
+    if (entries == NULL || bufs == NULL) {
+        perror("could not allocate the message buffers");
+        exitAndClean(fd);
+    }
+
+    stats.start = nowUs();
+    while ((opts.limit == 0 || stats.messages < opts.limit) && emptyRun < opts.channels &&
+           (opts.drain || reads < opts.channels)) {
+        n = opts.batch;
+        if (opts.limit != 0 && opts.limit - stats.messages < n) {
+            n = opts.limit - stats.messages;
+        }
+        if (!opts.drain && opts.channels - reads < n) {
+            n = opts.channels - reads; // One read per channel
+        }
+        reads += n;
+        for (i = 0; i < n; i++) {
+            entries[i].channel_id = opts.firstChannel + next;
+            entries[i].buffer = (uintptr_t) (bufs + i * BUF_LEN);
+            entries[i].length = BUF_LEN;
+            next = (next + 1) % opts.channels;
+        }
+        readMessages(fd, &opts, entries, n, &stats);
+        for (i = 0; i < n; i++) {
+            if (entries[i].status < 0 && entries[i].status != -EWOULDBLOCK) {
+                fprintf(stderr, "channel %llu: %s\n", entries[i].channel_id, strerror(-entries[i].status));
+                errors++;
+                emptyRun++; // No message from it this pass either
+                continue;
+            }
+            if (entries[i].status <= 0) {
+                stats.misses++;
+                emptyRun++;
+                continue;
+            }
+            length = entries[i].status;
+            if (opts.lengthDelimited) {
+                fwrite(&length, sizeof(length), 1, stdout);
+            }
+            fwrite(bufs + i * BUF_LEN, 1, length, stdout);
+            if (!opts.lengthDelimited) {
+                putchar('\n');
+            }
+            stats.messages++;
+            stats.bytes += length;
+            emptyRun = 0;
+        }
+    }
+    if (fflush(stdout) != 0) {
+        perror("failed writing to STDOUT");
+    }
+    reportStream(&stats, "empty");
+
+    free(entries);
+    free(bufs);
+    close(fd);
+    return errors != 0;
+}
+
 int main(int c, char **args) {
     char *deviceFile, *msg;     // Pointers to hold device file path and message buffer
     long channelId;             // Variable to store channel ID
     int fd, retVal;             // File descriptor and return value variables
 
+    if (c >= 3 && strcmp(args[2], "--stream") == 0) {
+        return streamMain(c, args); // Many messages over one descriptor
+    }
+
     // Check if the number of arguments is correct
     if (c != 3) {
         printf("wrong amount of arguments given: %s", strerror(1));
@@ -1,3 +1,7 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // For getline and clock_gettime under -std=c11
+#endif
+
 #include <stdlib.h>      // For standard library functions like exit, strtol
 #include <stdio.h>       // For standard I/O functions like printf, perror
 #include <errno.h>       // For error handling
@@ -5,8 +9,10 @@
 #include <limits.h>      // For defining data type limits, like UINT_MAX
 #include <fcntl.h>       // For file control options (open flags)
 #include <unistd.h>      // For standard symbolic constants and types, like STDOUT_FILENO
+#include <stdint.h>      // For uintptr_t
 #include <sys/ioctl.h>   // For ioctl system call
 #include "message_slot.h" // Include header for message slot ioctl definitions
+#include "message_stream.h" // For the streaming mode's options and statistics
 
 // Function to close the file descriptor
 void clean(int fd) {
@@ -19,11 +25,147 @@ void exitAndClean(int fd) {
     exit(errno); // Exit with the current error number
 }
 
+// Function to read the next message of a stream. Returns its length, 0 at the end of the input,
+// or -1 for a message that is empty or longer than BUF_LEN (it is skipped)
+int nextMessage(FILE *in, int lengthDelimited, char *buf) {
+    static char *line = NULL;   // getline's buffer, reused across messages
+    static size_t capacity = 0;
+    unsigned int length;
+    ssize_t n;
+    if (lengthDelimited) {
+        if (fread(&length, sizeof(length), 1, in) != 1) {
+            return 0;
+        }
+        if (length == 0 || length > BUF_LEN) {
+            while (length-- > 0 && getc(in) != EOF); // Skip the payload
+            return -1;
+        }
+        return fread(buf, 1, length, in) == length ? (int) length : 0; // A truncated message ends the input
+    }
+    if ((n = getline(&line, &capacity, in)) < 0) {
+        return 0;
+    }
+    if (n > 0 && line[n - 1] == '\n') {
+        n--;
+    }
+    if (n == 0 || n > BUF_LEN) {
+        return -1;
+    }
+    memcpy(buf, line, n);
+    return (int) n;
+}
+
+// Function to send n prepared messages in one call and account for them. Batched writes never
+// block, so a message for a full queue-mode channel is dropped; with -b 1 a write may block
+void sendMessages(int fd, const StreamOptions *opts, struct msg_slot_batch_entry *entries,
+                  unsigned int n, StreamStats *stats) {
+    struct msg_slot_batch batch;
+    double start = nowUs();
+    unsigned int i;
+    ssize_t written;
+    if (opts->batch == 1) {
+        if (ioctl(fd, MSG_SLOT_CHANNEL, (unsigned long) entries[0].channel_id) < 0) {
+            perror("Failed to set channel ID using ioctl");
+            exitAndClean(fd);
+        }
+        written = write(fd, (char *) (uintptr_t) entries[0].buffer, entries[0].length);
+        entries[0].status = written < 0 ? -errno : (int) written;
+    } else {
+        batch.op = MSG_SLOT_BATCH_WRITE;
+        batch.count = n;
+        batch.entries = (uintptr_t) entries;
+        if (ioctl(fd, MSG_SLOT_BATCH, &batch) < 0) {
+            perror("Failed to write a batch of messages");
+            exitAndClean(fd);
+        }
+    }
+    recordCall(stats, nowUs() - start);
+    for (i = 0; i < n; i++) {
+        if (entries[i].status > 0) {
+            stats->messages++;
+            stats->bytes += entries[i].status;
+        } else {
+            stats->misses++;
+        }
+    }
+}
+
+// Function to run the streaming mode: send every message of the input over a channel range,
+// round-robin, through a single file descriptor
+int streamMain(int c, char **args) {
+    StreamOptions opts;
+    StreamStats stats = {0};
+    struct msg_slot_batch_entry *entries;
+    char *bufs;
+    FILE *in;
+    unsigned long next = 0, i;
+    unsigned int n;
+    int fd, length;
+
+    if (parseStreamOptions(c, args, &opts) != 0 || opts.drain) {
+        fprintf(stderr, "usage: %s DEVICE --stream FIRST_CHANNEL COUNT [-l] [-b BATCH] [-q DEPTH] [FILE]\n"
+                        "  -l  messages are prefixed by a 4-byte length instead of ending in a newline\n"
+                        "  -b  messages per MSG_SLOT_BATCH call (1: ioctl and write per message)\n"
+                        "  -q  put the channels in queue mode with this depth first\n", args[0]);
+        exit(1);
+    }
+    if ((in = opts.file == NULL ? stdin : fopen(opts.file, "rb")) == NULL) {
+        perror("Failed to open the input file");
+        exit(1);
+    }
+    fd = open(args[1], O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open the device file");
+        exit(1);
+    }
+    for (i = 0; opts.queueDepth != 0 && i < opts.channels; i++) {
+        if (ioctl(fd, MSG_SLOT_CHANNEL, opts.firstChannel + i) < 0 ||
+            ioctl(fd, MSG_SLOT_QUEUE_MODE, opts.queueDepth) < 0) {
+            perror("Failed to put a channel in queue mode");
+            exitAndClean(fd);
+        }
+    }
+    entries = calloc(opts.batch, sizeof(*entries));
+    bufs = malloc((size_t) opts.batch * BUF_LEN);
+    if (entries == NULL || bufs == NULL) {
+        perror("Failed to allocate the message buffers");
+        exitAndClean(fd);
+    }
+
+    stats.start = nowUs();
+    do {
+        for (n = 0; n < opts.batch && (length = nextMessage(in, opts.lengthDelimited, bufs + n * BUF_LEN)) != 0; ) {
+            if (length < 0) {
+                stats.misses++; // Can't be sent as a message
+                continue;
+            }
+            entries[n].channel_id = opts.firstChannel + next;
+            entries[n].buffer = (uintptr_t) (bufs + n * BUF_LEN);
+            entries[n].length = length;
+            next = (next + 1) % opts.channels;
+            n++;
+        }
+        if (n > 0) {
+            sendMessages(fd, &opts, entries, n, &stats);
+        }
+    } while (n == opts.batch);
+    reportStream(&stats, "dropped");
+
+    free(entries);
+    free(bufs);
+    close(fd);
+    return 0;
+}
+
 int main(int c, char **args) {
     char *deviceFile, *msg;     // Pointers to hold device file path and message
     long channelId;             // Variable to store channel ID
     int fd;                     // File descriptor
 
+    if (c >= 3 && strcmp(args[2], "--stream") == 0) {
+        return streamMain(c, args); // Many messages from stdin or a file over one descriptor
+    }
+
     // Check if the number of arguments is correct (expected 4 arguments)
     if (c != 4) {
         perror("Incorrect number of arguments provided");
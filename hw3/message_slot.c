@@ -1,4 +1,7 @@
 #include "message_slot.h" // Include header for message slot definitions
+#ifdef MSG_SLOT_USER
+#include "message_slot_user.h" // Builds the channel store in user space, see bench_slot.c
+#else
 #undef __KERNEL__         // Undefine __KERNEL__ if previously defined
 #define __KERNEL__        // Define __KERNEL__ for kernel module code
 #undef MODULE             // Undefine MODULE if previously defined
@@ -8,264 +11,1163 @@
 #include <linux/module.h>  // For module initialization and cleanup macros
 #include <linux/fs.h>      // For file operations structure and functions
 #include <linux/uaccess.h> // For copy_to_user and copy_from_user functions
+#include <linux/uio.h>     // For iov_iter, so a message can be scattered or gathered
 #include <linux/string.h>  // For string manipulation functions like memcpy
 #include <linux/slab.h>    // For memory allocation functions
+#include <linux/mm.h>      // For kvcalloc and kvfree
+#include <linux/hash.h>    // For hash_long
+#include <linux/mutex.h>   // For the per-device and device array mutexes
+#include <linux/seqlock.h> // For the per-channel publish and resize seqcounts
+#include <linux/rcupdate.h> // For RCU-protected bucket arrays and chains
+#include <linux/srcu.h>    // For channel users that sleep while holding a node
+#include <linux/refcount.h> // For pinning channels across blocking queue-mode calls
+#include <linux/jiffies.h> // For channel idle times
+#include <linux/wait.h>    // For blocking queue-mode readers and writers
+#include <linux/poll.h>    // For poll/epoll readiness
+#include <linux/percpu.h>  // For the per-CPU statistics
+#include <linux/debugfs.h> // For exporting the statistics
+#include <linux/seq_file.h> // For formatting the statistics
+#include <linux/version.h> // For the minimum kernel check below
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#error "message_slot needs Linux 6.5 or later (copy_splice_read, import_ubuf, ITER_DEST/ITER_SOURCE)"
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h" // Tracepoints of the file operations
+#endif
 
 MODULE_LICENSE("GPL");     // Specify the module's license as GPL
 #define SUCCESS 0          // Define SUCCESS as 0 for successful operations
 #define MSG_MAX_LENGTH 128 // Define maximum message length
 #define MAX_DEVICES ((1u<<8u)+1) // Define maximum number of devices (256 + 1)
 
-typedef struct _ListNode {
-    int channelId;        // Channel ID for the node
-    char *msg;            // Pointer to message
-    int msgLength;        // Length of the message
-    struct _ListNode *next; // Pointer to the next node in the list
-} ListNode;
-
-typedef struct _LinkedList {
-    ListNode *first;      // Pointer to the first node in the list
-    int size;             // Size of the linked list
-} LinkedList;
-
-static LinkedList *devices[MAX_DEVICES] = {NULL}; // Array to store devices' linked lists
-
-// Function to find a node with a specific channelId in a linked list
-ListNode *findChannelId(LinkedList *lst, int channelId) {
-    ListNode *node = lst->first;
-    while (node != NULL) {
-        if (node->channelId == channelId) {
-            return node; // Return node if channelId matches
+#define INITIAL_BUCKETS_BITS 4 // Each device starts with 1 << 4 hash buckets
+#define MAX_LOAD_FACTOR 2      // Grow the table when it holds more than buckets * 2 channels
+#define MAX_SHARED_SPINS 10000 // Give up with -EBUSY if a mapped channel's seq stays odd this long
+#define BATCH_CHUNK 8          // Batch entries copied in from user space at a time (on the stack)
+#define CHANNEL_IDLE_SECS 30   // Channels untouched this long may be evicted when a device is over budget
+#define CHANNEL_EVICTED 1      // Internal status: the node was evicted meanwhile, look the channel up again
+
+static unsigned long budget_kb = 64 * 1024; // Memory budget of each device's channels, in KiB
+module_param(budget_kb, ulong, 0644);
+MODULE_PARM_DESC(budget_kb, "Memory budget of each message slot device's channels, in KiB");
+
+// Concurrency: channel lookups never lock. Bucket arrays and chains are published with SRCU, and a
+// lookup that misses while the table is being resized retries (nodes move between chains during a
+// resize). Creating a channel or resizing takes the device's mutex. Each channel has its own writer
+// mutex and two message buffers: a writer copies from user space straight into the unpublished buffer,
+// then flips the published index under a seqcount. Readers copy to user space straight from the
+// published buffer and retry if a flip happened meanwhile, so every message costs a single copy.
+// A mapped channel keeps its message in a shared page instead (struct msg_slot_shared), which user space
+// may also write; there the kernel follows the same seq protocol as user space, through a staging copy
+// so it never holds the seq odd across a user access.
+// A channel in queue mode instead keeps a ring of messages, guarded by the writer mutex for
+// producers and consumers alike, with wait queues for blocking on an empty or full ring.
+// Nodes come from a dedicated slab cache with both message buffers inline. Every node, ring and
+// shared page is charged to its device's budget (budget_kb); when creating a channel would exceed
+// it, channels idle for CHANNEL_IDLE_SECS are evicted, losing their message. Mapped channels,
+// channels in queue mode and polled channels are never evicted. Files name channels by ID, so a file
+// whose channel was evicted simply finds it empty. Users of a node hold the SRCU read lock (they may
+// sleep in user copies), so an evicted node is freed only after they are done; blocking queue-mode
+// calls drop the lock while they wait and pin the node with a reference instead.
+
+typedef struct _ChannelNode {
+    unsigned long channelId;  // Channel ID for the node
+    struct mutex writeLock;   // Serializes writers, who may sleep while copying from user space
+    seqcount_mutex_t seq;     // Bumped when a writer publishes, lets readers detect a torn copy
+    int active;               // Which of the two buffers holds the published message
+    int msgLength;            // Length of the published message
+    unsigned long generation; // Number of messages published in single-message mode
+    int queueDepth;           // Ring capacity in queue mode, 0 in single-message mode
+    int queueHead;            // Ring index of the oldest queued message
+    int queueCount;           // Number of queued messages
+    char *ring;               // queueDepth MSG_MAX_LENGTH slots, followed by their lengths
+    struct page *shared;      // Page holding the message once the channel was mmap'd, else NULL
+    wait_queue_head_t readQueue;  // Readers waiting for a queued message, pollers for any new message
+    wait_queue_head_t writeQueue; // Writers (and pollers) waiting for a free ring slot
+    struct _ChannelNode __rcu *next; // Pointer to the next node in the same bucket
+    unsigned long lastUsed;   // jiffies of the last read or write, for idle eviction
+    bool evicted;             // Set under writeLock once the node left its table
+    refcount_t refs;          // The table's reference plus one per blocking queue-mode call
+    struct rcu_head rcu;      // For freeing an evicted node after its users are done
+    char msg[2][MSG_MAX_LENGTH] ____cacheline_aligned; // The published message and a staging one
+} ChannelNode;
+
+typedef struct _BucketArray {
+    struct rcu_head rcu;      // For freeing a replaced array after readers are done with it
+    unsigned int bits;        // log2 of the number of buckets
+    ChannelNode __rcu *heads[]; // 1 << bits bucket chains
+} BucketArray;
+
+typedef struct _ChannelTable {
+    BucketArray __rcu *buckets; // Current bucket array
+    struct mutex lock;        // Serializes inserts and resizes
+    seqcount_mutex_t resizeSeq; // Bumped around a resize, so lockless misses can retry
+    int size;                 // Number of channels in the table (protected by lock)
+    atomic_long_t memory;     // Bytes of nodes, rings and shared pages charged to the budget
+    wait_queue_head_t createQueue; // Pollers bound to a channel that doesn't exist yet
+} ChannelTable;
+
+typedef struct _FileState {
+    unsigned long channelId;  // Channel set with MSG_SLOT_CHANNEL, 0 if none
+    unsigned long seenGeneration; // Generation of the last message read, for poll readiness
+} FileState;
+
+static ChannelTable *devices[MAX_DEVICES] = {NULL}; // Array to store devices' channel tables
+static DEFINE_MUTEX(devicesLock); // Serializes creating tables in devices
+static struct kmem_cache *nodeCache; // Slab cache of channel nodes
+DEFINE_STATIC_SRCU(channelSrcu);  // Protects bucket arrays and nodes from being freed under their users
+
+// Function to get the bucket chain a channelId hashes to
+static ChannelNode __rcu **bucketOf(BucketArray *buckets, unsigned long channelId) {
+    return &buckets->heads[hash_long(channelId, buckets->bits)];
+}
+
+// Function to allocate an empty bucket array with 1 << bits buckets
+static BucketArray *createBuckets(unsigned int bits) {
+    return kvzalloc(struct_size((BucketArray *) NULL, heads, 1u << bits), GFP_KERNEL);
+}
+
+// SRCU callback freeing a bucket array that was replaced by a resize
+static void freeBucketsRcu(struct rcu_head *head) {
+    kvfree(container_of(head, BucketArray, rcu));
+}
+
+// Function to allocate an empty channel table
+ChannelTable *createTable(void) {
+    ChannelTable *tbl;
+    BucketArray *buckets;
+    tbl = kmalloc(sizeof(ChannelTable), GFP_KERNEL);
+    if (tbl == NULL) return NULL;
+    buckets = createBuckets(INITIAL_BUCKETS_BITS);
+    if (buckets == NULL) {
+        kfree(tbl);
+        return NULL;
+    }
+    buckets->bits = INITIAL_BUCKETS_BITS;
+    RCU_INIT_POINTER(tbl->buckets, buckets);
+    mutex_init(&tbl->lock);
+    seqcount_mutex_init(&tbl->resizeSeq, &tbl->lock);
+    tbl->size = 0;
+    atomic_long_set(&tbl->memory, 0);
+    init_waitqueue_head(&tbl->createQueue);
+    return tbl;
+}
+
+// Function to double the number of buckets and rehash every channel into them. Called with tbl->lock held.
+// If the allocation fails the table keeps working with longer chains
+static void growTable(ChannelTable *tbl) {
+    BucketArray *old, *newBuckets;
+    ChannelNode *node, *next;
+    unsigned int i;
+    old = rcu_dereference_protected(tbl->buckets, lockdep_is_held(&tbl->lock));
+    newBuckets = createBuckets(old->bits + 1);
+    if (newBuckets == NULL) return;
+    newBuckets->bits = old->bits + 1;
+
+    write_seqcount_begin(&tbl->resizeSeq);
+    for (i = 0; i < (1u << old->bits); i++) {
+        node = rcu_dereference_protected(old->heads[i], lockdep_is_held(&tbl->lock));
+        for (; node != NULL; node = next) {
+            ChannelNode __rcu **bucket = bucketOf(newBuckets, node->channelId);
+            next = rcu_dereference_protected(node->next, lockdep_is_held(&tbl->lock));
+            // A reader standing on node now continues down the new chain; it may miss its
+            // channel, which the resizeSeq retry in findChannelId covers
+            rcu_assign_pointer(node->next, rcu_dereference_protected(*bucket, lockdep_is_held(&tbl->lock)));
+            rcu_assign_pointer(*bucket, node);
         }
-        node = node->next;
     }
-    return NULL; // Return NULL if not found
+    rcu_assign_pointer(tbl->buckets, newBuckets);
+    write_seqcount_end(&tbl->resizeSeq);
+    call_srcu(&channelSrcu, &old->rcu, freeBucketsRcu); // Readers may still be walking the old array
 }
 
-// Function to set a message for a specific node
-void setMsg(ListNode *node, const char *msg, int msgLength) {
-    memcpy(node->msg, msg, msgLength); // Copy the message to the node's msg
-    node->msgLength = msgLength;       // Set the message length
+// Function to find a node with a specific channelId in a channel table, without locking.
+// The caller holds channelSrcu, which keeps the node alive until it unlocks
+ChannelNode *findChannelId(ChannelTable *tbl, unsigned long channelId) {
+    ChannelNode *node;
+    unsigned int seq;
+    do {
+        seq = read_seqcount_begin(&tbl->resizeSeq);
+        node = srcu_dereference(*bucketOf(srcu_dereference(tbl->buckets, &channelSrcu), channelId), &channelSrcu);
+        while (node != NULL && node->channelId != channelId) {
+            node = srcu_dereference(node->next, &channelSrcu);
+        }
+        if (node != NULL) {
+            return node; // Return node if channelId matches
+        }
+    } while (read_seqcount_retry(&tbl->resizeSeq, seq)); // A resize may have hidden the node
+    return NULL; // Return NULL if not found
 }
 
-// Function to create a new node for a specific channelId
-ListNode *createNode(int channelId) {
-    ListNode *node;
-    node = kmalloc(sizeof(ListNode), GFP_KERNEL); // Allocate memory for the node
+// Function to create a new node for a specific channelId. With nowait the allocation doesn't sleep
+ChannelNode *createNode(unsigned long channelId, bool nowait) {
+    ChannelNode *node;
+    node = kmem_cache_alloc(nodeCache, nowait ? GFP_NOWAIT : GFP_KERNEL); // One allocation, message buffers included
     if (node == NULL) return NULL; // Return NULL if allocation fails
-    node->msg = kmalloc(sizeof(char) * MSG_MAX_LENGTH, GFP_KERNEL); // Allocate memory for the message
-    if (node->msg == NULL) {
-        kfree(node); // Free the node if message allocation fails
-        return NULL;
-    }
     node->channelId = channelId; // Set the channelId
-    node->next = NULL;           // Initialize the next pointer to NULL
+    mutex_init(&node->writeLock);
+    seqcount_mutex_init(&node->seq, &node->writeLock);
+    node->active = 0;
+    node->msgLength = 0;         // No message written yet
+    node->generation = 0;
+    node->queueDepth = 0;        // Single-message mode until MSG_SLOT_QUEUE_MODE
+    node->queueHead = 0;
+    node->queueCount = 0;
+    node->ring = NULL;
+    node->shared = NULL;
+    init_waitqueue_head(&node->readQueue);
+    init_waitqueue_head(&node->writeQueue);
+    RCU_INIT_POINTER(node->next, NULL); // Initialize the next pointer to NULL
+    node->lastUsed = jiffies;
+    node->evicted = false;
+    refcount_set(&node->refs, 1); // The table's reference
     return node;
 }
 
-// Function to get or create a node for a specific channelId in a linked list
-ListNode *getOrCreateNode(LinkedList *lst, int channelId) {
-    ListNode *newNode, *prevNode, *node;
-    if (lst->size == 0) { // If the list is empty
-        newNode = createNode(channelId);
-        if (newNode == NULL) return NULL; // Return NULL if node creation fails
-        lst->first = newNode;             // Set the first node in the list
-        lst->size++;
-        return newNode;
-    } else {
-        prevNode = NULL;
-        node = lst->first;
-        do {
-            if (channelId == node->channelId) {
-                return node; // Return existing node if channelId matches
-            } else if (channelId < node->channelId) {
-                newNode = createNode(channelId);
-                if (newNode == NULL) return NULL; // Return NULL if node creation fails
-                if (prevNode == NULL) {
-                    newNode->next = node;
-                    lst->first = newNode; // Insert the new node at the beginning
-                } else {
-                    newNode->next = node;
-                    prevNode->next = newNode; // Insert the new node between prevNode and node
-                }
-                lst->size++;
-                return newNode;
+// Function to free a node's memory
+void freeNode(ChannelNode *node) {
+    mutex_destroy(&node->writeLock);
+    kfree(node->ring); // Free the queue-mode ring, if any
+    if (node->shared != NULL) {
+        put_page(node->shared); // Mappings hold their own references to the page
+    }
+    kmem_cache_free(nodeCache, node); // Free the node memory
+}
+
+// RCU callback freeing an evicted node once epoll is done with its wait queues
+static void freeNodeRcu(struct rcu_head *head) {
+    freeNode(container_of(head, ChannelNode, rcu));
+}
+
+// Function to drop a reference to an evicted node, freeing it with the last one
+static void releaseNode(ChannelNode *node) {
+    if (refcount_dec_and_test(&node->refs)) {
+        wake_up_pollfree(&node->readQueue); // Polled nodes aren't evicted; this is only a safety net
+        wake_up_pollfree(&node->writeQueue);
+        call_rcu(&node->rcu, freeNodeRcu);
+    }
+}
+
+// SRCU callback dropping the table's reference to an evicted node, once no lookup can still use it
+static void evictedNodeSrcu(struct rcu_head *head) {
+    releaseNode(container_of(head, ChannelNode, rcu));
+}
+
+// Function to note that a channel was used. Stores at most once per jiffy, so readers of a busy
+// channel don't keep pulling its cache line away from each other
+static void touchNode(ChannelNode *node) {
+    unsigned long now = jiffies;
+    if (READ_ONCE(node->lastUsed) != now) {
+        WRITE_ONCE(node->lastUsed, now);
+    }
+}
+
+// Function to get a device's memory budget in bytes
+static long budgetBytes(void) {
+    return (long) min_t(unsigned long, READ_ONCE(budget_kb), LONG_MAX / 1024) * 1024;
+}
+
+// Function to evict idle channels until the device is comfortably under budget. A node is unlinked
+// and marked evicted under its writeLock, so no write can land in it afterwards; it is freed once
+// the lookups that may have found it are done. Pollers register under the same lock (device_poll),
+// so a node found without sleepers here can't gain one until it is marked evicted
+static void evictIdle(ChannelTable *tbl) {
+    BucketArray *buckets;
+    ChannelNode __rcu **link;
+    ChannelNode *node;
+    unsigned int i;
+    long target = budgetBytes() / 8 * 7;
+    unsigned long idle = CHANNEL_IDLE_SECS * HZ;
+    mutex_lock(&tbl->lock);
+    buckets = rcu_dereference_protected(tbl->buckets, lockdep_is_held(&tbl->lock));
+    for (i = 0; i < (1u << buckets->bits) && atomic_long_read(&tbl->memory) > target; i++) {
+        link = &buckets->heads[i];
+        while ((node = rcu_dereference_protected(*link, lockdep_is_held(&tbl->lock))) != NULL) {
+            if (!time_after(jiffies, READ_ONCE(node->lastUsed) + idle) ||
+                !mutex_trylock(&node->writeLock)) {
+                link = &node->next; // Recently used or busy right now
+                continue;
+            }
+            if (node->queueDepth != 0 || node->shared != NULL ||
+                wq_has_sleeper(&node->readQueue) || wq_has_sleeper(&node->writeQueue)) {
+                mutex_unlock(&node->writeLock);
+                link = &node->next; // Its contents can't be thrown away, or it is polled
+                continue;
             }
-            prevNode = node;
-            node = node->next;
-        } while (node != NULL);
+            // Lookups standing on node still continue down the chain through node->next
+            rcu_assign_pointer(*link, rcu_dereference_protected(node->next, lockdep_is_held(&tbl->lock)));
+            node->evicted = true;
+            mutex_unlock(&node->writeLock);
+            tbl->size--;
+            atomic_long_sub(kmem_cache_size(nodeCache), &tbl->memory);
+            call_srcu(&channelSrcu, &node->rcu, evictedNodeSrcu);
+        }
+    }
+    mutex_unlock(&tbl->lock);
+}
 
-        newNode = createNode(channelId);
-        if (newNode == NULL) return NULL; // Return NULL if node creation fails
-        prevNode->next = newNode; // Insert the new node at the end of the list
-        lst->size++;
-        return newNode;
+// Function to charge bytes to a device's budget, evicting idle channels if it would be exceeded.
+// Eviction sleeps, so with nowait it is left to a retry. Returns 0, -ENOSPC or -EAGAIN
+static int chargeMemory(ChannelTable *tbl, long bytes, bool nowait) {
+    if (atomic_long_add_return(bytes, &tbl->memory) <= budgetBytes()) {
+        return SUCCESS;
     }
+    if (nowait) {
+        atomic_long_sub(bytes, &tbl->memory);
+        return -EAGAIN;
+    }
+    evictIdle(tbl);
+    if (atomic_long_read(&tbl->memory) <= budgetBytes()) {
+        return SUCCESS;
+    }
+    atomic_long_sub(bytes, &tbl->memory);
+    return -ENOSPC;
 }
 
-// Function to free a node's memory
-void freeNode(ListNode *node) {
-    kfree(node->msg); // Free the message memory
-    kfree(node);      // Free the node memory
+// Function to get a channel's shared page contents, NULL if the channel was never mapped
+static struct msg_slot_shared *sharedOf(ChannelNode *node) {
+    struct page *page = smp_load_acquire(&node->shared); // Pairs with mapChannel
+    return page == NULL ? NULL : page_address(page);
 }
 
-// Function to free a linked list's memory
-void freeLst(LinkedList *lst) {
-    ListNode *prev, *cur;
-    if (lst->size != 0) {
-        prev = lst->first;
-        cur = prev->next;
-        while (cur != NULL) {
-            freeNode(prev); // Free each node in the list
-            prev = cur;
-            cur = cur->next;
+// Function to wake the pollers waiting for a new message on a channel
+static void notifyReaders(ChannelNode *node) {
+    if (wq_has_sleeper(&node->readQueue)) { // Skip the wait queue lock when nobody polls
+        wake_up_interruptible_poll(&node->readQueue, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+// Function to write a message into a shared page following the seq protocol. Returns 0 or -EBUSY
+// if a user-space writer kept the seq odd for too long
+static int publishShared(struct msg_slot_shared *sh, const char *msg, int msgLength) {
+    unsigned int seq;
+    int spins;
+    for (spins = 0; spins < MAX_SHARED_SPINS; spins++) {
+        seq = READ_ONCE(sh->seq);
+        if ((seq & 1) == 0 && cmpxchg(&sh->seq, seq, seq + 1) == seq) {
+            memcpy(sh->msg, msg, msgLength);
+            WRITE_ONCE(sh->length, msgLength);
+            smp_store_release(&sh->seq, seq + 2);
+            return SUCCESS;
+        }
+        cpu_relax();
+    }
+    return -EBUSY;
+}
+
+// Function to copy the message out of a shared page following the seq protocol. Returns its length,
+// 0 if none was written, or -EBUSY if writers kept changing it
+static int snapshotShared(struct msg_slot_shared *sh, char *buffer, unsigned long *generation) {
+    unsigned int seq, msgLength;
+    int spins;
+    for (spins = 0; spins < MAX_SHARED_SPINS; spins++) {
+        seq = smp_load_acquire(&sh->seq);
+        if ((seq & 1) == 0) {
+            msgLength = min_t(unsigned int, READ_ONCE(sh->length), MSG_MAX_LENGTH); // User space may scribble
+            memcpy(buffer, sh->msg, msgLength);
+            smp_rmb();
+            if (READ_ONCE(sh->seq) == seq) {
+                *generation = seq / 2;
+                return msgLength;
+            }
         }
-        freeNode(prev); // Free the last node
+        cpu_relax();
     }
-    kfree(lst); // Free the linked list structure
+    return -EBUSY;
+}
+
+// Function to set a message for a specific node straight from an iterator (user buffers). Returns 0,
+// -ENOSPC, -EAGAIN if nowait and the node is busy, or CHANNEL_EVICTED if the node left its table
+// (with nothing consumed from msg)
+int setMsg(ChannelNode *node, struct iov_iter *msg, int msgLength, bool nowait) {
+    char *staging;
+    struct msg_slot_shared *sh;
+    int status;
+    if (nowait) {
+        if (!mutex_trylock(&node->writeLock)) {
+            return -EAGAIN;
+        }
+    } else {
+        mutex_lock(&node->writeLock);
+    }
+    if (node->evicted) {
+        mutex_unlock(&node->writeLock);
+        return CHANNEL_EVICTED; // Nobody could read the message from here
+    }
+    staging = node->msg[1 - node->active]; // No reader relies on this buffer
+    if (copy_from_iter(staging, msgLength, msg) != msgLength) {
+        mutex_unlock(&node->writeLock);
+        return -ENOSPC; // Return error if copy from user space fails
+    }
+    if ((sh = sharedOf(node)) != NULL) {
+        status = publishShared(sh, staging, msgLength);
+        mutex_unlock(&node->writeLock);
+        if (status == SUCCESS) {
+            notifyReaders(node);
+        }
+        return status;
+    }
+    write_seqcount_begin(&node->seq);
+    node->active = 1 - node->active; // Publish the staging buffer
+    node->msgLength = msgLength;     // Set the message length
+    WRITE_ONCE(node->generation, node->generation + 1);
+    write_seqcount_end(&node->seq);
+    mutex_unlock(&node->writeLock);
+    notifyReaders(node);
+    return SUCCESS;
+}
+
+// Function to copy a node's published message straight to an iterator (user buffers). Returns its
+// length, -EWOULDBLOCK if no message was written yet or -ENOSPC if it doesn't fit in the iterator.
+// The generation of the message read is stored in seen
+ssize_t getMsg(ChannelNode *node, struct iov_iter *to, unsigned long *seen) {
+    unsigned int seq;
+    int msgLength;
+    size_t length = iov_iter_count(to), copied;
+    unsigned long generation;
+    struct msg_slot_shared *sh;
+    char snapshot[MSG_MAX_LENGTH];
+    if ((sh = sharedOf(node)) != NULL) {
+        // User space can write the page at any time, so take a consistent copy first
+        if ((msgLength = snapshotShared(sh, snapshot, &generation)) <= 0) {
+            return msgLength == 0 ? -EWOULDBLOCK : msgLength;
+        }
+        if (length < msgLength || copy_to_iter(snapshot, msgLength, to) != msgLength) {
+            return -ENOSPC; // Buffers too small, or copy to user space failed
+        }
+        WRITE_ONCE(*seen, generation);
+        return msgLength;
+    }
+    for (;;) {
+        seq = read_seqcount_begin(&node->seq);
+        msgLength = node->msgLength;
+        generation = node->generation;
+        copied = 0; // Decided on msgLength alone if it doesn't fit, only valid if no writer published meanwhile
+        if (msgLength != 0 && length >= msgLength) {
+            copied = copy_to_iter(node->msg[node->active], msgLength, to);
+        }
+        if (!read_seqcount_retry(&node->seq, seq)) {
+            break;
+        }
+        iov_iter_revert(to, copied); // A writer published (and may reuse our buffer)
+    }
+    if (msgLength == 0) {
+        return -EWOULDBLOCK; // The channel exists but nothing was written to it yet
+    }
+    if (copied != msgLength) {
+        return -ENOSPC; // Buffers too small, or copy to user space failed
+    }
+    WRITE_ONCE(*seen, generation);
+    return msgLength;
+}
+
+// Function to get the length of a ring slot (the lengths follow the message slots)
+static int *ringLength(ChannelNode *node, int index) {
+    return (int *) (node->ring + node->queueDepth * MSG_MAX_LENGTH) + index;
+}
+
+// Function to take a node's writeLock before a queue-mode call. With nowait it doesn't sleep.
+// Returns 0, -ERESTARTSYS or -EAGAIN
+static int lockQueue(ChannelNode *node, bool nowait) {
+    if (nowait) {
+        return mutex_trylock(&node->writeLock) ? SUCCESS : -EAGAIN;
+    }
+    return mutex_lock_interruptible(&node->writeLock) != 0 ? -ERESTARTSYS : SUCCESS;
+}
+
+// Function to queue a message straight from an iterator, blocking while the ring is full.
+// Falls back to setMsg if the channel left queue mode. nowait (which implies nonblock) never sleeps
+ssize_t enqueueMsg(ChannelNode *node, struct iov_iter *msg, int msgLength, bool nonblock, bool nowait) {
+    int tail, status;
+    if ((status = lockQueue(node, nowait)) != SUCCESS) {
+        return status;
+    }
+    while (node->queueDepth != 0 && node->queueCount == node->queueDepth) {
+        mutex_unlock(&node->writeLock);
+        if (nonblock) {
+            return -EWOULDBLOCK; // Ring full and the caller doesn't want to wait
+        }
+        if (wait_event_interruptible_exclusive(node->writeQueue,
+                READ_ONCE(node->queueCount) < READ_ONCE(node->queueDepth) ||
+                READ_ONCE(node->queueDepth) == 0) != 0) {
+            wake_up_interruptible(&node->writeQueue); // Pass on a wakeup we may have consumed
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&node->writeLock) != 0) {
+            return -ERESTARTSYS;
+        }
+    }
+    if (node->queueDepth == 0) {
+        mutex_unlock(&node->writeLock);
+        return setMsg(node, msg, msgLength, nowait);
+    }
+    tail = (node->queueHead + node->queueCount) % node->queueDepth;
+    if (copy_from_iter(node->ring + tail * MSG_MAX_LENGTH, msgLength, msg) != msgLength) {
+        mutex_unlock(&node->writeLock);
+        wake_up_interruptible(&node->writeQueue); // Pass on a wakeup we may have consumed
+        return -ENOSPC; // Return error if copy from user space fails
+    }
+    *ringLength(node, tail) = msgLength;
+    WRITE_ONCE(node->queueCount, node->queueCount + 1);
+    mutex_unlock(&node->writeLock);
+    wake_up_interruptible(&node->readQueue); // Hand the message to one waiting reader
+    return SUCCESS;
+}
+
+// Function to consume the oldest queued message straight to an iterator, blocking while the ring is
+// empty. A message that doesn't fit in the iterator stays queued. Falls back to getMsg if the channel
+// left queue mode. nowait (which implies nonblock) never sleeps
+ssize_t dequeueMsg(ChannelNode *node, struct iov_iter *to, bool nonblock, bool nowait, unsigned long *seen) {
+    int msgLength, status;
+    if ((status = lockQueue(node, nowait)) != SUCCESS) {
+        return status;
+    }
+    while (node->queueDepth != 0 && node->queueCount == 0) {
+        mutex_unlock(&node->writeLock);
+        if (nonblock) {
+            return -EWOULDBLOCK; // Nothing queued and the caller doesn't want to wait
+        }
+        if (wait_event_interruptible_exclusive(node->readQueue,
+                READ_ONCE(node->queueCount) > 0 || READ_ONCE(node->queueDepth) == 0) != 0) {
+            wake_up_interruptible(&node->readQueue); // Pass on a wakeup we may have consumed
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&node->writeLock) != 0) {
+            return -ERESTARTSYS;
+        }
+    }
+    if (node->queueDepth == 0) {
+        mutex_unlock(&node->writeLock);
+        return getMsg(node, to, seen);
+    }
+    msgLength = *ringLength(node, node->queueHead);
+    if (iov_iter_count(to) < msgLength ||
+        copy_to_iter(node->ring + node->queueHead * MSG_MAX_LENGTH, msgLength, to) != msgLength) {
+        mutex_unlock(&node->writeLock);
+        wake_up_interruptible(&node->readQueue); // Pass on a wakeup we may have consumed
+        return -ENOSPC; // Buffers too small, or copy to user space failed
+    }
+    node->queueHead = (node->queueHead + 1) % node->queueDepth;
+    WRITE_ONCE(node->queueCount, node->queueCount - 1);
+    mutex_unlock(&node->writeLock);
+    wake_up_interruptible(&node->writeQueue); // Let one blocked writer use the freed slot
+    return msgLength;
+}
+
+// Function to get the size of a queue-mode ring of depth messages
+static long ringSize(int depth) {
+    return depth * (MSG_MAX_LENGTH + sizeof(int));
+}
+
+// Function to switch a channel between single-message mode (depth 0) and queue mode. Changing the
+// depth discards queued messages; the single message is kept separately and survives both ways.
+// Returns 0, a negative error or CHANNEL_EVICTED
+int setQueueDepth(ChannelTable *tbl, ChannelNode *node, int depth) {
+    char *ring = NULL, *oldRing;
+    int oldDepth;
+    if (depth < 0 || depth > MAX_QUEUE_DEPTH) {
+        return -EINVAL;
+    }
+    if (sharedOf(node) != NULL) {
+        return -EBUSY; // A mapped channel holds exactly one message
+    }
+    if (depth > 0) {
+        if (chargeMemory(tbl, ringSize(depth), false) != SUCCESS) {
+            return -ENOSPC; // Over budget even after evicting idle channels
+        }
+        ring = kmalloc(ringSize(depth), GFP_KERNEL);
+        if (ring == NULL) {
+            atomic_long_sub(ringSize(depth), &tbl->memory);
+            return -ENOMEM;
+        }
+    }
+    mutex_lock(&node->writeLock);
+    if (node->evicted) {
+        mutex_unlock(&node->writeLock);
+        atomic_long_sub(ringSize(depth), &tbl->memory);
+        kfree(ring);
+        return CHANNEL_EVICTED;
+    }
+    oldRing = node->ring;
+    oldDepth = node->queueDepth;
+    node->ring = ring;
+    WRITE_ONCE(node->queueDepth, depth);
+    node->queueHead = 0;
+    WRITE_ONCE(node->queueCount, 0);
+    mutex_unlock(&node->writeLock);
+    // Blocked readers and writers re-check the mode; exclusive waiters need an explicit wake-all
+    wake_up_interruptible_all(&node->readQueue);
+    wake_up_interruptible_all(&node->writeQueue);
+    kfree(oldRing);
+    atomic_long_sub(ringSize(oldDepth), &tbl->memory);
+    return SUCCESS;
+}
+
+// Function to give a channel a shared page, moving its current message there. Returns 0, -ENOMEM,
+// -ENOSPC over budget, -EBUSY for a channel in queue mode, or CHANNEL_EVICTED
+int mapChannel(ChannelTable *tbl, ChannelNode *node) {
+    struct page *page;
+    struct msg_slot_shared *sh;
+    bool charged = READ_ONCE(node->shared) == NULL;
+    int status;
+    if (charged && chargeMemory(tbl, PAGE_SIZE, false) != SUCCESS) {
+        return -ENOSPC; // Charged before locking, eviction may need the node's lock
+    }
+    mutex_lock(&node->writeLock);
+    if (node->shared != NULL || node->queueDepth != 0 || node->evicted) {
+        status = node->shared != NULL ? SUCCESS : node->queueDepth != 0 ? -EBUSY : CHANNEL_EVICTED;
+        mutex_unlock(&node->writeLock);
+        if (charged) {
+            atomic_long_sub(PAGE_SIZE, &tbl->memory); // Already mapped by another file, or refused
+        }
+        return status;
+    }
+    if ((page = alloc_page(GFP_KERNEL | __GFP_ZERO)) == NULL) {
+        mutex_unlock(&node->writeLock);
+        atomic_long_sub(PAGE_SIZE, &tbl->memory);
+        return -ENOMEM;
+    }
+    sh = page_address(page);
+    memcpy(sh->msg, node->msg[node->active], node->msgLength);
+    sh->length = node->msgLength;
+    sh->seq = node->generation * 2; // Keep generations increasing for pollers
+    smp_store_release(&node->shared, page); // From now on the page holds the message
+    mutex_unlock(&node->writeLock);
+    return SUCCESS;
+}
+
+// Function to get or create a node for a specific channelId in a channel table. The caller holds
+// channelSrcu. Returns NULL if allocation fails or the device is over budget, or with nowait also if
+// creating the node would have to sleep
+ChannelNode *getOrCreateNode(ChannelTable *tbl, unsigned long channelId, bool nowait) {
+    ChannelNode *node, *newNode;
+    BucketArray *buckets;
+    ChannelNode __rcu **bucket;
+    if ((node = findChannelId(tbl, channelId)) != NULL) {
+        return node; // Fast path: the channel exists, no lock taken
+    }
+    if (chargeMemory(tbl, kmem_cache_size(nodeCache), nowait) != SUCCESS) {
+        return NULL; // Over budget even after evicting idle channels
+    }
+    newNode = createNode(channelId, nowait); // Allocate before locking, the loser of a race frees it
+    if (newNode == NULL) {
+        atomic_long_sub(kmem_cache_size(nodeCache), &tbl->memory);
+        return NULL; // Return NULL if node creation fails
+    }
+
+    if (nowait) {
+        if (!mutex_trylock(&tbl->lock)) {
+            freeNode(newNode);
+            atomic_long_sub(kmem_cache_size(nodeCache), &tbl->memory);
+            return NULL;
+        }
+    } else {
+        mutex_lock(&tbl->lock);
+    }
+    buckets = rcu_dereference_protected(tbl->buckets, lockdep_is_held(&tbl->lock));
+    bucket = bucketOf(buckets, channelId);
+    node = rcu_dereference_protected(*bucket, lockdep_is_held(&tbl->lock));
+    while (node != NULL && node->channelId != channelId) {
+        node = rcu_dereference_protected(node->next, lockdep_is_held(&tbl->lock));
+    }
+    if (node != NULL) {
+        mutex_unlock(&tbl->lock);
+        freeNode(newNode); // Another writer created the channel first
+        atomic_long_sub(kmem_cache_size(nodeCache), &tbl->memory);
+        return node;
+    }
+    RCU_INIT_POINTER(newNode->next, rcu_dereference_protected(*bucket, lockdep_is_held(&tbl->lock)));
+    rcu_assign_pointer(*bucket, newNode); // Publish the fully initialized node to readers
+    tbl->size++;
+    if (!nowait && tbl->size > MAX_LOAD_FACTOR << buckets->bits) {
+        growTable(tbl); // Allocates and may sleep; a later blocking creation grows the table instead
+    }
+    mutex_unlock(&tbl->lock);
+    if (wq_has_sleeper(&tbl->createQueue)) {
+        wake_up_interruptible(&tbl->createQueue); // Pollers of this channel move to its own queues
+    }
+    return newNode;
+}
+
+// Function to free a channel table's memory. Only called at module exit, with no users left
+void freeTable(ChannelTable *tbl) {
+    BucketArray *buckets = rcu_dereference_protected(tbl->buckets, 1);
+    ChannelNode *node, *next;
+    unsigned int i;
+    for (i = 0; i < (1u << buckets->bits); i++) {
+        for (node = rcu_dereference_protected(buckets->heads[i], 1); node != NULL; node = next) {
+            next = rcu_dereference_protected(node->next, 1);
+            freeNode(node); // Free each node in the bucket
+        }
+    }
+    kvfree(buckets);
+    mutex_destroy(&tbl->lock);
+    kfree(tbl); // Free the table structure
+}
+
+// Function to read a channel's message straight to an iterator (in queue mode, consume the oldest).
+// nonblock doesn't wait for a message; nowait (io_uring's IOCB_NOWAIT) doesn't sleep at all
+static ssize_t channelRead(ChannelTable *tbl, unsigned long channelId, struct iov_iter *to,
+                           bool nonblock, bool nowait, unsigned long *seen) {
+    ChannelNode *node;
+    ssize_t status;
+    int idx = srcu_read_lock(&channelSrcu);
+    if ((node = findChannelId(tbl, channelId)) == NULL) {
+        srcu_read_unlock(&channelSrcu, idx);
+        return -EWOULDBLOCK; // Return error if no message is found for the channel
+    }
+    touchNode(node);
+    if (READ_ONCE(node->queueDepth) != 0) {
+        refcount_inc(&node->refs); // May block for long: pin the node instead of holding up SRCU
+        srcu_read_unlock(&channelSrcu, idx);
+        status = dequeueMsg(node, to, nonblock, nowait, seen);
+        releaseNode(node);
+        return status;
+    }
+    status = getMsg(node, to, seen); // Consistent copy, even with concurrent writers
+    srcu_read_unlock(&channelSrcu, idx);
+    return status;
+}
+
+// Function to write the whole contents of an iterator to a channel as one message. Returns the length
+// written. nonblock doesn't wait for room; nowait (io_uring's IOCB_NOWAIT) doesn't sleep at all
+static ssize_t channelWrite(ChannelTable *tbl, unsigned long channelId, struct iov_iter *from,
+                            bool nonblock, bool nowait) {
+    ChannelNode *node;
+    size_t length = iov_iter_count(from);
+    int status, idx;
+    if (length > BUF_LEN || length <= 0) {
+        return -EMSGSIZE; // Return error if message size is invalid
+    }
+    idx = srcu_read_lock(&channelSrcu);
+    do {
+        if ((node = getOrCreateNode(tbl, channelId, nowait)) == NULL) {
+            status = nowait ? -EAGAIN : -ENOSPC; // A blocking retry reports the real error
+            break;
+        }
+        touchNode(node);
+        if (READ_ONCE(node->queueDepth) != 0) {
+            refcount_inc(&node->refs); // May block for long: pin the node instead of holding up SRCU
+            srcu_read_unlock(&channelSrcu, idx);
+            status = enqueueMsg(node, from, length, nonblock, nowait);
+            releaseNode(node);
+            idx = srcu_read_lock(&channelSrcu);
+        } else {
+            status = setMsg(node, from, length, nowait);
+        }
+    } while (status == CHANNEL_EVICTED); // Lost a race with eviction, write to a fresh node
+    srcu_read_unlock(&channelSrcu, idx);
+    if (status != SUCCESS) {
+        return status; // Return error if copy from user space fails
+    }
+    return length;
+}
+
+// Function to set up the channel store shared by all devices
+static int storeInit(void) {
+    nodeCache = kmem_cache_create("message_slot_channel", sizeof(ChannelNode), 0,
+                                  SLAB_HWCACHE_ALIGN, NULL); // Nodes start on their own cache line
+    return nodeCache == NULL ? -ENOMEM : SUCCESS;
+}
+
+// Function to free every device's channels and the store itself, once no file can use them
+static void storeExit(void) {
+    ChannelTable **tmp, **limit;
+    limit = devices + MAX_DEVICES;
+    srcu_barrier(&channelSrcu); // Let pending bucket array and evicted node frees run before
+    rcu_barrier();              // their callbacks' code goes away
+    for (tmp = devices + 1; tmp < limit; tmp++) {
+        if (*tmp != NULL) {
+            freeTable(*tmp); // Free memory for each device's channel table
+            *tmp = NULL;
+        }
+    }
+    kmem_cache_destroy(nodeCache);
+}
+
+#ifndef MSG_SLOT_USER // Everything below is the character device around the channel store
+
+// Function to get the channel table of the device a file was opened on
+static ChannelTable *tableOf(struct file *file) {
+    return smp_load_acquire(&devices[iminor(file->f_inode) + 1]); // Pairs with device_open
+}
+
+typedef struct _SlotStats {
+    unsigned long opens;      // Successful opens
+    unsigned long reads;      // Successful reads, batch entries included
+    unsigned long writes;     // Successful writes, batch entries included
+    unsigned long bytes;      // Bytes read and written
+    unsigned long misses;     // Reads that found no message (EWOULDBLOCK)
+} SlotStats;
+
+static DEFINE_PER_CPU(SlotStats, slotStats); // Each CPU counts its own calls, summed when read
+static struct dentry *debugDir;              // message_slot directory in debugfs
+
+// Function to count a finished read in this CPU's statistics
+static void countRead(ssize_t status) {
+    if (status >= 0) {
+        this_cpu_inc(slotStats.reads);
+        this_cpu_add(slotStats.bytes, status);
+    } else if (status == -EWOULDBLOCK) {
+        this_cpu_inc(slotStats.misses);
+    }
+}
+
+// Function to count a finished write in this CPU's statistics
+static void countWrite(ssize_t status) {
+    if (status >= 0) {
+        this_cpu_inc(slotStats.writes);
+        this_cpu_add(slotStats.bytes, status);
+    }
+}
+
+// Function to print the statistics summed over all CPUs, plus the live channels of all devices
+static int stats_show(struct seq_file *m, void *v) {
+    SlotStats sum = {0};
+    ChannelTable *tbl;
+    long channels = 0;
+    int cpu, i;
+    for_each_possible_cpu(cpu) {
+        sum.opens += per_cpu(slotStats, cpu).opens;
+        sum.reads += per_cpu(slotStats, cpu).reads;
+        sum.writes += per_cpu(slotStats, cpu).writes;
+        sum.bytes += per_cpu(slotStats, cpu).bytes;
+        sum.misses += per_cpu(slotStats, cpu).misses;
+    }
+    for (i = 1; i < MAX_DEVICES; i++) {
+        if ((tbl = smp_load_acquire(&devices[i])) != NULL) {
+            channels += READ_ONCE(tbl->size);
+        }
+    }
+    seq_printf(m, "opens %lu\nreads %lu\nwrites %lu\nbytes %lu\nmisses %lu\nchannels %ld\n",
+               sum.opens, sum.reads, sum.writes, sum.bytes, sum.misses, channels);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+// Function to set up a file opened on a device, creating the device's table on its first open
+static int openDevice(struct inode *inode, struct file *file) {
+    int minor;
+    ChannelTable *tbl;
+    minor = iminor(inode); // Get the minor number of the device
+    if (smp_load_acquire(&devices[minor + 1]) == NULL) {
+        mutex_lock(&devicesLock); // Two first opens of a minor must not both create a table
+        if (devices[minor + 1] == NULL) {
+            printk(KERN_INFO "Adding minor %d to device array\n", minor);
+            tbl = createTable(); // Allocate an empty channel table
+            if (tbl == NULL) {
+                mutex_unlock(&devicesLock);
+                return -ENOMEM; // Return error if allocation fails
+            }
+            smp_store_release(&devices[minor + 1], tbl); // Publish only once fully initialized
+        }
+        mutex_unlock(&devicesLock);
+    }
+    file->private_data = kzalloc(sizeof(FileState), GFP_KERNEL); // No channel set yet
+    if (file->private_data == NULL) {
+        return -ENOMEM;
+    }
+    file->f_mode |= FMODE_NOWAIT; // io_uring may try IOCB_NOWAIT first; such calls never sleep
+    return SUCCESS;
 }
 
 // Device open function
 static int device_open(struct inode *inode,
                        struct file *file) {
-    int minor;
-    printk(KERN_INFO "Device opened (file pointer: %p)\n", file);
-
-    minor = iminor(inode); // Get the minor number of the device
-    if (devices[minor + 1] == NULL) {
-        printk(KERN_INFO "Adding minor %d to device array\n", minor);
-        devices[minor + 1] = kmalloc(sizeof(LinkedList), GFP_KERNEL); // Allocate memory for the linked list
-        if (devices[minor + 1] == NULL) return -1; // Return error if allocation fails
-        devices[minor + 1]->size = 0; // Initialize the size of the list to 0
+    int status = openDevice(inode, file);
+    if (status == SUCCESS) {
+        this_cpu_inc(slotStats.opens);
     }
+    trace_msgslot_open(iminor(inode), status);
+    return status;
+}
+
+// Device release function
+static int device_release(struct inode *inode,
+                          struct file *file) {
+    kfree(file->private_data); // Free the file's channel state
     return SUCCESS;
 }
 
-// Device read function
-static ssize_t device_read(struct file *file,
-                           char __user *buffer,
-                           size_t length,
-                           loff_t *offset) {
-    int status, minor;
+// Function to tell whether a request must not block (O_NONBLOCK, or io_uring's non-blocking attempt)
+static bool nonblocking(struct kiocb *iocb) {
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+// Device read_iter function. Scatters the message over the request's buffers (read, readv, io_uring)
+static ssize_t device_read_iter(struct kiocb *iocb,
+                                struct iov_iter *to) {
     unsigned long channelId;
-    LinkedList *lst;
-    ListNode *node;
-    char *tmpBuffer;
-    printk(KERN_INFO "Device read invoked (file pointer: %p, length: %ld)\n", file, length);
-    if (file->private_data == NULL) {
-        return -EINVAL; // Return error if no channel is set
+    struct file *file = iocb->ki_filp;
+    FileState *fs = file->private_data;
+    ChannelTable *tbl;
+    size_t length = iov_iter_count(to);
+    ssize_t status;
+    channelId = READ_ONCE(fs->channelId);
+    tbl = tableOf(file);
+    if (channelId == 0 || tbl == NULL) {
+        status = -EINVAL; // No channel is set, or no channel table is associated with the device
+    } else {
+        status = channelRead(tbl, channelId, to, nonblocking(iocb), iocb->ki_flags & IOCB_NOWAIT,
+                             &fs->seenGeneration);
+    }
+    countRead(status);
+    trace_msgslot_read(iminor(file_inode(file)), channelId, length, status);
+    return status;
+}
+
+// Function to run a MSG_SLOT_BATCH request. Entries are copied in a chunk at a time and their
+// statuses copied back; a per-entry failure doesn't stop the batch
+static long batchIo(struct file *file, struct msg_slot_batch __user *arg) {
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry chunk[BATCH_CHUNK];
+    struct msg_slot_batch_entry __user *entries;
+    ChannelTable *tbl = tableOf(file);
+    struct iov_iter iter;
+    unsigned long seen;
+    unsigned int done, n, i;
+    if (tbl == NULL || copy_from_user(&batch, arg, sizeof(batch)) != 0) {
+        return -EINVAL;
     }
-    channelId = (unsigned long) file->private_data;
-    minor = iminor(file->f_inode);
-    lst = devices[minor + 1];
-    if (lst == NULL) {
-        return -EINVAL; // Return error if no linked list is associated with the device
+    if (batch.count > MAX_BATCH ||
+        (batch.op != MSG_SLOT_BATCH_READ && batch.op != MSG_SLOT_BATCH_WRITE)) {
+        return -EINVAL; // Return error if the batch is too large or the operation unknown
     }
-    node = findChannelId(lst, channelId);
-    if (node != NULL) {
-        if (length < node->msgLength || buffer == NULL) {
-            return -ENOSPC; // Return error if buffer is too small or NULL
+    entries = u64_to_user_ptr(batch.entries);
+    for (done = 0; done < batch.count; done += n) {
+        n = min_t(unsigned int, batch.count - done, BATCH_CHUNK);
+        if (copy_from_user(chunk, entries + done, n * sizeof(chunk[0])) != 0) {
+            return -EFAULT;
         }
-        if ((tmpBuffer = kmalloc(sizeof(char) * node->msgLength, GFP_KERNEL)) == NULL) {
-            return -ENOSPC; // Return error if temporary buffer allocation fails
+        for (i = 0; i < n; i++) {
+            if (chunk[i].channel_id == 0) {
+                chunk[i].status = -EINVAL; // Same rule as MSG_SLOT_CHANNEL
+            } else if (import_ubuf(batch.op == MSG_SLOT_BATCH_READ ? ITER_DEST : ITER_SOURCE,
+                                   u64_to_user_ptr(chunk[i].buffer), chunk[i].length, &iter) != 0) {
+                chunk[i].status = -EFAULT;
+            } else if (batch.op == MSG_SLOT_BATCH_READ) {
+                chunk[i].status = channelRead(tbl, chunk[i].channel_id, &iter, true, false, &seen);
+                countRead(chunk[i].status);
+                trace_msgslot_read(iminor(file_inode(file)), chunk[i].channel_id, chunk[i].length,
+                                   chunk[i].status);
+            } else {
+                chunk[i].status = channelWrite(tbl, chunk[i].channel_id, &iter, true, false);
+                countWrite(chunk[i].status);
+                trace_msgslot_write(iminor(file_inode(file)), chunk[i].channel_id, chunk[i].length,
+                                    chunk[i].status);
+            }
         }
-        memcpy(tmpBuffer, node->msg, node->msgLength); // Copy message to temporary buffer
-        if ((status = copy_to_user(buffer, tmpBuffer, node->msgLength)) != 0) {
-            kfree(tmpBuffer); // Free temporary buffer before returning error
-            return -ENOSPC; // Return error if copy to user space fails
+        if (copy_to_user(entries + done, chunk, n * sizeof(chunk[0])) != 0) {
+            return -EFAULT;
         }
-        kfree(tmpBuffer); // Free temporary buffer
-        return node->msgLength; // Return the length of the message
     }
-    return -EWOULDBLOCK; // Return error if no message is found for the channel
+    return SUCCESS;
 }
 
-// Device ioctl function
-static long device_ioctl(struct file *file,
-                         unsigned int ioctl_command_id,
-                         unsigned long ioctl_param) {
+// Function to run an ioctl command on a file
+static long ioctlDevice(struct file *file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    unsigned long channelId;
+    FileState *fs = file->private_data;
+    ChannelTable *tbl;
+    ChannelNode *node;
+    int status, idx;
     if (MSG_SLOT_CHANNEL == ioctl_command_id && ioctl_param != 0) {
-        file->private_data = (void *) ioctl_param; // Set channel ID as private data
-        printk(KERN_INFO "IOCTL invoked: setting channelId to %ld\n", ioctl_param);
+        WRITE_ONCE(fs->channelId, ioctl_param); // Set channel ID in the file's state
+        WRITE_ONCE(fs->seenGeneration, 0); // The channel's current message is unread for this file
+        return SUCCESS;
+    } else if (MSG_SLOT_QUEUE_MODE == ioctl_command_id) {
+        channelId = READ_ONCE(fs->channelId);
+        tbl = tableOf(file);
+        if (channelId == 0 || tbl == NULL || ioctl_param > MAX_QUEUE_DEPTH) {
+            return -EINVAL; // Return error if no channel is set or the depth is invalid
+        }
+        idx = srcu_read_lock(&channelSrcu);
+        do {
+            node = getOrCreateNode(tbl, channelId, false);
+            status = node == NULL ? -ENOSPC : setQueueDepth(tbl, node, (int) ioctl_param);
+        } while (status == CHANNEL_EVICTED); // Lost a race with eviction, switch a fresh node
+        srcu_read_unlock(&channelSrcu, idx);
+        return status;
+    } else if (MSG_SLOT_BATCH == ioctl_command_id) {
+        return batchIo(file, (struct msg_slot_batch __user *) ioctl_param);
+    } else if (MSG_SLOT_NOTIFY == ioctl_command_id) {
+        channelId = READ_ONCE(fs->channelId);
+        tbl = tableOf(file);
+        if (channelId == 0 || tbl == NULL) {
+            return -EINVAL; // Return error if no channel is set
+        }
+        idx = srcu_read_lock(&channelSrcu);
+        if ((node = findChannelId(tbl, channelId)) != NULL) {
+            notifyReaders(node);
+        }
+        srcu_read_unlock(&channelSrcu, idx);
         return SUCCESS;
     } else {
         return -EINVAL; // Return error if invalid command or parameter
     }
 }
 
-// Device write function
-static ssize_t device_write(struct file *file,
-                            const char __user *buffer,
-                            size_t length,
-                            loff_t *offset) {
+// Device ioctl function
+static long device_ioctl(struct file *file,
+                         unsigned int ioctl_command_id,
+                         unsigned long ioctl_param) {
+    long status = ioctlDevice(file, ioctl_command_id, ioctl_param);
+    trace_msgslot_ioctl(iminor(file_inode(file)), ioctl_command_id, ioctl_param, status);
+    return status;
+}
+
+// Device write_iter function. Gathers one message from the request's buffers (write, writev, io_uring)
+static ssize_t device_write_iter(struct kiocb *iocb,
+                                 struct iov_iter *from) {
     unsigned long channelId;
-    int status, minor;
-    char *tmpBuffer;
-    ListNode *node;
-    printk(KERN_INFO "Device write invoked (file pointer: %p, length: %ld)\n", file, length);
+    struct file *file = iocb->ki_filp;
+    FileState *fs = file->private_data;
+    ChannelTable *tbl;
+    size_t length = iov_iter_count(from);
+    ssize_t status;
+    channelId = READ_ONCE(fs->channelId);
+    tbl = tableOf(file);
     if (length > BUF_LEN || length <= 0) {
-        return -EMSGSIZE; // Return error if message size is invalid
+        status = -EMSGSIZE; // Message size is invalid
+    } else if (channelId == 0 || tbl == NULL) {
+        status = -EINVAL; // No channel is set, or no channel table is associated with the device
+    } else {
+        status = channelWrite(tbl, channelId, from, nonblocking(iocb), iocb->ki_flags & IOCB_NOWAIT);
     }
-    if (file->private_data == NULL) {
-        return -EINVAL; // Return error if no channel is set
+    countWrite(status);
+    trace_msgslot_write(iminor(file_inode(file)), channelId, length, status);
+    return status;
+}
+
+// Function to get the generation of a channel's current message, for poll readiness
+static unsigned long generationOf(ChannelNode *node) {
+    struct msg_slot_shared *sh = sharedOf(node);
+    return sh == NULL ? READ_ONCE(node->generation) : READ_ONCE(sh->seq) / 2;
+}
+
+// Device poll function. Readable when the file's channel has a message this file hasn't read yet
+// (queue mode: any queued message); writable unless the channel is a full queue
+static __poll_t device_poll(struct file *file,
+                            poll_table *wait) {
+    unsigned long channelId;
+    FileState *fs = file->private_data;
+    ChannelTable *tbl;
+    ChannelNode *node;
+    __poll_t mask = 0;
+    int depth, idx;
+    channelId = READ_ONCE(fs->channelId);
+    tbl = tableOf(file);
+    if (channelId == 0 || tbl == NULL) {
+        return EPOLLERR; // No channel set
     }
-    channelId = (unsigned long) file->private_data;
-    if (buffer == NULL) {
-        return -ENOSPC; // Return error if buffer is NULL
+    idx = srcu_read_lock(&channelSrcu);
+    while (true) {
+        node = findChannelId(tbl, channelId);
+        if (node == NULL) {
+            poll_wait(file, &tbl->createQueue, wait); // Re-polled once the channel exists
+            node = findChannelId(tbl, channelId);
+            if (node == NULL) {
+                srcu_read_unlock(&channelSrcu, idx);
+                return EPOLLOUT | EPOLLWRNORM; // A write would create the channel
+            }
+        }
+        if (poll_does_not_wait(wait)) {
+            break; // A re-poll that registers nothing doesn't need the lock
+        }
+        // Register under writeLock: evictIdle checks for sleepers under it, so either it sees us and
+        // keeps the node, or it evicted the node first and we look the channel up again. Eviction
+        // would otherwise detach our entries with wake_up_pollfree, and epoll would never re-register
+        mutex_lock(&node->writeLock);
+        if (node->evicted) {
+            mutex_unlock(&node->writeLock);
+            continue;
+        }
+        poll_wait(file, &node->readQueue, wait);
+        poll_wait(file, &node->writeQueue, wait);
+        mutex_unlock(&node->writeLock);
+        break;
     }
-    minor = iminor(file->f_inode);
-    if (devices[minor + 1] == NULL) {
-        return -EINVAL; // Return error if no linked list is associated with the device
+    depth = READ_ONCE(node->queueDepth);
+    if (depth != 0) {
+        if (READ_ONCE(node->queueCount) > 0) mask |= EPOLLIN | EPOLLRDNORM;
+        if (READ_ONCE(node->queueCount) < depth) mask |= EPOLLOUT | EPOLLWRNORM;
+    } else {
+        if (generationOf(node) != READ_ONCE(fs->seenGeneration)) mask |= EPOLLIN | EPOLLRDNORM;
+        mask |= EPOLLOUT | EPOLLWRNORM;
     }
-    if ((node = getOrCreateNode(devices[minor + 1], channelId)) == NULL) {
-        return -ENOSPC; // Return error if node creation fails
+    srcu_read_unlock(&channelSrcu, idx);
+    return mask;
+}
+
+// Device mmap function. Maps the shared page of the file's current channel (struct msg_slot_shared)
+static int device_mmap(struct file *file,
+                       struct vm_area_struct *vma) {
+    unsigned long channelId;
+    FileState *fs = file->private_data;
+    ChannelTable *tbl;
+    ChannelNode *node;
+    int status, idx;
+    channelId = READ_ONCE(fs->channelId);
+    tbl = tableOf(file);
+    if (channelId == 0 || tbl == NULL) {
+        return -EINVAL; // Return error if no channel is set
     }
-    node->msgLength = length; // Set the length of the message
-    if ((tmpBuffer = kmalloc(sizeof(char) * length, GFP_KERNEL)) == NULL) {
-        return -ENOSPC; // Return error if temporary buffer allocation fails
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE || !(vma->vm_flags & VM_SHARED)) {
+        return -EINVAL; // Only a single shared page at offset 0
     }
-    if ((status = copy_from_user(tmpBuffer, buffer, length)) != 0) {
-        kfree(tmpBuffer); // Free temporary buffer before returning error
-        return -ENOSPC; // Return error if copy from user space fails
+    idx = srcu_read_lock(&channelSrcu);
+    do {
+        node = getOrCreateNode(tbl, channelId, false);
+        status = node == NULL ? -ENOSPC : mapChannel(tbl, node);
+    } while (status == CHANNEL_EVICTED); // Lost a race with eviction, map a fresh node
+    if (status == SUCCESS) {
+        status = vm_insert_page(vma, vma->vm_start, node->shared); // Takes its own page reference
     }
-    setMsg(node, tmpBuffer, length); // Set the message in the node
-    kfree(tmpBuffer); // Free temporary buffer
-    return length;
+    srcu_read_unlock(&channelSrcu, idx);
+    return status;
 }
 
 // File operations structure
 struct file_operations Fops = {
     .owner          = THIS_MODULE,
-    .read           = device_read,
-    .write          = device_write,
+    .read_iter      = device_read_iter,
+    .write_iter     = device_write_iter,
+    .splice_read    = copy_splice_read,
+    .splice_write   = iter_file_splice_write,
     .open           = device_open,
+    .release        = device_release,
     .unlocked_ioctl = device_ioctl,
+    .poll           = device_poll,
+    .mmap           = device_mmap,
 };
 
 // Module initialization function
 static int __init simple_init(void) {
     int success;
+    if (storeInit() != SUCCESS) {
+        return -ENOMEM;
+    }
     printk(KERN_INFO "Registering device with major number %d and name %s\n", MAJOR_NUM, DEVICE_RANGE_NAME);
     success = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &Fops);
     if (success < 0) {
         printk(KERN_ERR "Registration failed for %s with major number %d. Received status: %d\n",
                DEVICE_RANGE_NAME, MAJOR_NUM, success);
+        storeExit();
         return MAJOR_NUM;
     }
     printk(KERN_INFO "Registration successful.\n");
+    debugDir = debugfs_create_dir(DEVICE_RANGE_NAME, NULL); // Statistics are optional, errors ignored
+    debugfs_create_file("stats", 0444, debugDir, NULL, &stats_fops);
     return 0;
 }
 
 // Module cleanup function
 static void __exit simple_cleanup(void) {
-    LinkedList **tmp, **limit;
-    limit = devices + MAX_DEVICES;
+    debugfs_remove_recursive(debugDir);
     printk(KERN_INFO "Freeing allocated memory for devices\n");
-    for (tmp = devices + 1; tmp < limit; tmp++) {
-        if (*tmp != NULL) {
-            freeLst(*tmp); // Free memory for each device's linked list
-        }
-    }
+    storeExit();
     printk(KERN_INFO "Memory freeing complete\n");
     unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME); // Unregister the character device
     printk(KERN_INFO "Device successfully unregistered\n");
@@ -273,3 +1175,4 @@ static void __exit simple_cleanup(void) {
 
 module_init(simple_init); // Define module initialization function
 module_exit(simple_cleanup); // Define module cleanup function
+#endif // MSG_SLOT_USER
@@ -13,12 +13,63 @@
 // unsigned long is the type of data that will be passed with this command
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned long)
 
+// Define an ioctl command to switch the current channel into queue mode
+// The parameter is the number of messages the channel keeps (1 to MAX_QUEUE_DEPTH); reads then
+// consume the oldest message and block while the channel is empty, writes block while it is full
+// (O_NONBLOCK makes both fail with EWOULDBLOCK instead). 0 switches back to single-message mode
+#define MSG_SLOT_QUEUE_MODE _IOW(MAJOR_NUM, 1, unsigned long)
+
+// Define an ioctl command to wake the pollers of the current channel
+// Used by producers that wrote a message through the mmap'd page (see struct msg_slot_shared)
+#define MSG_SLOT_NOTIFY _IO(MAJOR_NUM, 2)
+
+// Define an ioctl command to read or write many channels in one call
+// The parameter points to a struct msg_slot_batch; every entry gets its own status, and the call
+// never blocks (an empty queue-mode channel or a full one gives EWOULDBLOCK for that entry)
+#define MSG_SLOT_BATCH _IOWR(MAJOR_NUM, 3, struct msg_slot_batch)
+
+// Define the operations a batch can perform
+#define MSG_SLOT_BATCH_READ 0
+#define MSG_SLOT_BATCH_WRITE 1
+
 // Define the name of the device as it will appear in /dev
 #define DEVICE_RANGE_NAME "message_slot"
 
 // Define the maximum buffer length for messages
 #define BUF_LEN 128
 
+// Define the maximum number of messages a channel in queue mode can hold
+#define MAX_QUEUE_DEPTH 64
+
+// Layout of the page mmap maps for the current channel of a file (offset 0, at most one page, MAP_SHARED)
+// Once a channel is mapped its message lives in this page, and read/write on the device use it too.
+// Writer: wait for seq to be even, cmpxchg it to seq + 1, fill msg and length, store-release seq + 2,
+// then ioctl(MSG_SLOT_NOTIFY) to wake pollers.
+// Reader: load-acquire seq, retry while odd, copy length and msg, then retry if seq changed
+struct msg_slot_shared {
+    unsigned int seq;       // Odd while a writer is updating the message
+    unsigned int length;    // Length of the current message, 0 if none was written yet
+    char msg[BUF_LEN];      // The current message
+};
+
+// Define the maximum number of entries in one MSG_SLOT_BATCH call
+#define MAX_BATCH 1024
+
+// One channel access of a MSG_SLOT_BATCH call
+struct msg_slot_batch_entry {
+    unsigned long long channel_id; // Channel to read or write (non-zero)
+    unsigned long long buffer;     // User pointer to the message buffer
+    unsigned int length;           // Buffer size for reads, message length for writes
+    int status;                    // Out: bytes read or written, or a negative errno
+};
+
+// Argument of MSG_SLOT_BATCH
+struct msg_slot_batch {
+    unsigned int op;               // MSG_SLOT_BATCH_READ or MSG_SLOT_BATCH_WRITE
+    unsigned int count;            // Number of entries, at most MAX_BATCH
+    unsigned long long entries;    // User pointer to count struct msg_slot_batch_entry
+};
+
 // Define a success status code
 #define SUCCESS 0
 
@@ -0,0 +1,83 @@
+// Tracepoints of the message_slot device, under events/message_slot/ in tracefs.
+// Disabled tracepoints cost a patched-out branch, so they stay in the file operations for good
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(MSGSLOT_MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MSGSLOT_MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h> // For TRACE_EVENT and friends
+
+// A file was opened on a minor; ret is 0 or a negative errno
+TRACE_EVENT(msgslot_open,
+    TP_PROTO(int minor, int ret),
+    TP_ARGS(minor, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%d ret=%d", __entry->minor, __entry->ret)
+);
+
+// A message was read or written; ret is the message length or a negative errno
+DECLARE_EVENT_CLASS(msgslot_io,
+    TP_PROTO(int minor, unsigned long channel, size_t length, long ret),
+    TP_ARGS(minor, channel, length, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, channel)
+        __field(size_t, length)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel = channel;
+        __entry->length = length;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%d channel=%lu length=%zu ret=%ld",
+              __entry->minor, __entry->channel, __entry->length, __entry->ret)
+);
+
+DEFINE_EVENT(msgslot_io, msgslot_read,
+    TP_PROTO(int minor, unsigned long channel, size_t length, long ret),
+    TP_ARGS(minor, channel, length, ret)
+);
+
+DEFINE_EVENT(msgslot_io, msgslot_write,
+    TP_PROTO(int minor, unsigned long channel, size_t length, long ret),
+    TP_ARGS(minor, channel, length, ret)
+);
+
+// An ioctl was issued; ret is its return value
+TRACE_EVENT(msgslot_ioctl,
+    TP_PROTO(int minor, unsigned int cmd, unsigned long param, long ret),
+    TP_ARGS(minor, cmd, param, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, cmd)
+        __field(unsigned long, param)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->param = param;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%d cmd=0x%x param=%lu ret=%ld",
+              __entry->minor, __entry->cmd, __entry->param, __entry->ret)
+);
+
+#endif // MSGSLOT_MESSAGE_SLOT_TRACE_H
+
+// define_trace.h includes this header again from the module's directory (see CFLAGS in the Makefile)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>
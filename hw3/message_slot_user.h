@@ -0,0 +1,322 @@
+#ifndef MSGSLOT_MESSAGE_SLOT_USER_H
+#define MSGSLOT_MESSAGE_SLOT_USER_H
+
+// User-space stand-ins for the kernel APIs message_slot.c's channel store uses, so the store can be
+// built and measured without loading the module (define MSG_SLOT_USER before including
+// message_slot.c). Locks map to pthreads, iterator copies to memcpy and barriers to GCC atomics.
+// RCU and SRCU read sides are free: deferred frees are queued and only run at rcu_barrier or
+// srcu_barrier, which is always safe and fine for a benchmark's lifetime.
+
+#include <stdlib.h>      // For malloc, calloc, aligned_alloc and free
+#include <stdbool.h>     // For bool
+#include <stddef.h>      // For offsetof
+#include <stdint.h>      // For uintptr_t
+#include <string.h>      // For memcpy and memset
+#include <errno.h>       // For the errno values the store returns
+#include <limits.h>      // For LONG_MAX
+#include <time.h>        // For clock_gettime, behind jiffies
+#include <pthread.h>     // For mutexes and condition variables
+#include <sys/types.h>   // For ssize_t
+#include <sys/epoll.h>   // For the EPOLL* poll masks
+
+#define MODULE_LICENSE(license)
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+#define __user
+#define __rcu
+#define ____cacheline_aligned __attribute__((aligned(64)))
+
+#define ERESTARTSYS 512 // Kernel-internal, never returned here since waits aren't interrupted
+
+#define GFP_KERNEL 0
+#define GFP_NOWAIT 0
+#define __GFP_ZERO 1
+#define SLAB_HWCACHE_ALIGN 1
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096UL
+#endif
+#define HZ 100
+
+#define min_t(type, a, b) ((type) (a) < (type) (b) ? (type) (a) : (type) (b))
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define struct_size(p, member, n) (sizeof(*(p)) + (n) * sizeof((p)->member[0]))
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#define cmpxchg(p, old, new) ({                                                      \
+    __typeof__(*(p)) __expected = (old);                                             \
+    __atomic_compare_exchange_n((p), &__expected, (new), false,                      \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);                 \
+    __expected; })
+
+// Iterators, as a single user buffer like the kernel's ITER_UBUF
+
+#define ITER_DEST 0
+#define ITER_SOURCE 1
+
+struct iov_iter {
+    char *base;       // Next byte to copy to or from
+    size_t count;     // Bytes left
+};
+
+static inline void iov_iter_ubuf(struct iov_iter *i, int direction, void *buf, size_t count) {
+    (void) direction;
+    i->base = buf;
+    i->count = count;
+}
+
+#define iov_iter_count(i) ((i)->count)
+
+static inline size_t copy_to_iter(const void *from, size_t n, struct iov_iter *i) {
+    n = n < i->count ? n : i->count;
+    memcpy(i->base, from, n);
+    i->base += n;
+    i->count -= n;
+    return n;
+}
+
+static inline size_t copy_from_iter(void *to, size_t n, struct iov_iter *i) {
+    n = n < i->count ? n : i->count;
+    memcpy(to, i->base, n);
+    i->base += n;
+    i->count -= n;
+    return n;
+}
+
+static inline void iov_iter_revert(struct iov_iter *i, size_t n) {
+    i->base -= n;
+    i->count += n;
+}
+
+// Memory
+
+#define kmalloc(size, gfp) malloc(size)
+#define kvzalloc(size, gfp) calloc(1, (size))
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+
+struct kmem_cache {
+    size_t size;      // Object size, rounded up to a cache line with SLAB_HWCACHE_ALIGN
+    size_t align;     // Object alignment
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                                   unsigned long flags, void (*ctor)(void *)) {
+    struct kmem_cache *cache = malloc(sizeof(struct kmem_cache));
+    (void) name;
+    (void) ctor;
+    if (cache == NULL) return NULL;
+    cache->align = (flags & SLAB_HWCACHE_ALIGN) || align > 64 ? 64 : 16;
+    cache->size = (size + cache->align - 1) / cache->align * cache->align;
+    return cache;
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, int gfp) {
+    (void) gfp;
+    return aligned_alloc(cache->align, cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p) {
+    (void) cache;
+    free(p);
+}
+
+static inline unsigned int kmem_cache_size(struct kmem_cache *cache) {
+    return cache->size;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache) {
+    free(cache);
+}
+
+struct page {
+    char data[PAGE_SIZE];
+};
+
+static inline struct page *alloc_page(int gfp) {
+    struct page *page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (page != NULL && (gfp & __GFP_ZERO)) {
+        memset(page, 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+#define page_address(page) ((void *) (page))
+#define put_page(page) free(page) // Nothing maps pages in user space, so the store holds the only reference
+
+// Counters
+
+typedef struct { long counter; } atomic_long_t;
+typedef struct { int refs; } refcount_t;
+
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_add(i, v) ((void) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_long_sub(i, v) ((void) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_long_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define refcount_set(r, n) __atomic_store_n(&(r)->refs, (n), __ATOMIC_RELAXED)
+#define refcount_inc(r) ((void) __atomic_add_fetch(&(r)->refs, 1, __ATOMIC_RELAXED))
+#define refcount_dec_and_test(r) (__atomic_sub_fetch(&(r)->refs, 1, __ATOMIC_ACQ_REL) == 0)
+
+// Hashing and time
+
+static inline unsigned long hash_long(unsigned long val, unsigned int bits) {
+    return (unsigned long) (val * 0x61C8864680B583EBull) >> (64 - bits); // GOLDEN_RATIO_64
+}
+
+static inline unsigned long shimJiffies(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec * HZ + now.tv_nsec / (1000000000 / HZ);
+}
+
+#define jiffies shimJiffies()
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+
+// Locks
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(name) struct mutex name __attribute__((unused)) = {PTHREAD_MUTEX_INITIALIZER}
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_destroy(lock) pthread_mutex_destroy(&(lock)->m)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_lock_interruptible(lock) pthread_mutex_lock(&(lock)->m) // Never interrupted: returns 0
+#define mutex_trylock(lock) (pthread_mutex_trylock(&(lock)->m) == 0)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define lockdep_is_held(lock) 1
+
+typedef struct {
+    unsigned int sequence; // Odd while a writer is inside
+} seqcount_mutex_t;
+
+#define seqcount_mutex_init(s, lock) ((s)->sequence = 0)
+
+static inline unsigned int read_seqcount_begin(seqcount_mutex_t *s) {
+    unsigned int seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+static inline int read_seqcount_retry(seqcount_mutex_t *s, unsigned int seq) {
+    smp_rmb();
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_mutex_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    smp_wmb();
+}
+
+static inline void write_seqcount_end(seqcount_mutex_t *s) {
+    smp_wmb();
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+}
+
+// RCU and SRCU
+
+struct rcu_head {
+    struct rcu_head *next;                // Next deferred free
+    void (*func)(struct rcu_head *head);  // Callback freeing the object
+};
+
+struct srcu_struct {
+    int unused;
+};
+
+static struct rcu_head *shimDeferred = NULL; // Callbacks waiting for the next barrier
+static pthread_mutex_t shimDeferredLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void shimDefer(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    pthread_mutex_lock(&shimDeferredLock);
+    head->next = shimDeferred;
+    shimDeferred = head;
+    pthread_mutex_unlock(&shimDeferredLock);
+}
+
+// Function to run every deferred callback, including those the callbacks queue themselves
+static inline void shimBarrier(void) {
+    struct rcu_head *head, *next;
+    for (;;) {
+        pthread_mutex_lock(&shimDeferredLock);
+        head = shimDeferred;
+        shimDeferred = NULL;
+        pthread_mutex_unlock(&shimDeferredLock);
+        if (head == NULL) return;
+        for (; head != NULL; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+}
+
+#define DEFINE_STATIC_SRCU(name) static struct srcu_struct name __attribute__((unused))
+#define srcu_read_lock(s) 0
+#define srcu_read_unlock(s, idx) ((void) (idx))
+#define srcu_dereference(p, s) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define call_srcu(s, head, func) shimDefer((head), (func))
+#define call_rcu(head, func) shimDefer((head), (func))
+#define srcu_barrier(s) shimBarrier()
+#define rcu_barrier() shimBarrier()
+
+// Wait queues
+
+typedef struct {
+    pthread_mutex_t lock;  // Orders condition checks against wakeups
+    pthread_cond_t cond;   // Signalled on every wakeup
+    int sleepers;          // Threads waiting or about to
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) do {              \
+    pthread_mutex_init(&(wq)->lock, NULL);        \
+    pthread_cond_init(&(wq)->cond, NULL);         \
+    (wq)->sleepers = 0;                           \
+} while (0)
+
+// Never interrupted, so always evaluates to 0. The condition is checked under the queue's lock,
+// which a waker takes before signalling, so no wakeup is lost
+#define wait_event_interruptible_exclusive(wq, condition) ({        \
+    pthread_mutex_lock(&(wq).lock);                                 \
+    __atomic_add_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);        \
+    while (!(condition)) {                                          \
+        pthread_cond_wait(&(wq).cond, &(wq).lock);                  \
+    }                                                               \
+    __atomic_sub_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);        \
+    pthread_mutex_unlock(&(wq).lock);                               \
+    0; })
+
+static inline bool wq_has_sleeper(wait_queue_head_t *wq) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // Pairs with the increment before the condition check
+    return __atomic_load_n(&wq->sleepers, __ATOMIC_RELAXED) != 0;
+}
+
+static inline void shimWake(wait_queue_head_t *wq, bool all) {
+    pthread_mutex_lock(&wq->lock);
+    if (all) {
+        pthread_cond_broadcast(&wq->cond);
+    } else {
+        pthread_cond_signal(&wq->cond);
+    }
+    pthread_mutex_unlock(&wq->lock);
+}
+
+#define wake_up_interruptible(wq) shimWake((wq), false)
+#define wake_up_interruptible_all(wq) shimWake((wq), true)
+#define wake_up_interruptible_poll(wq, mask) shimWake((wq), true)
+#define wake_up_pollfree(wq) shimWake((wq), true)
+
+#endif // MSGSLOT_MESSAGE_SLOT_USER_H
@@ -0,0 +1,117 @@
+#ifndef MSGSLOT_MESSAGE_STREAM_H
+#define MSGSLOT_MESSAGE_STREAM_H
+
+// Helpers shared by the streaming modes of message_sender and message_reader: option parsing,
+// per-call latency recording and the final report (printed to stderr so stdout stays data)
+
+#include <stdlib.h>      // For malloc, realloc, qsort, strtoul
+#include <stdio.h>       // For fprintf
+#include <string.h>      // For strcmp
+#include <time.h>        // For clock_gettime
+#include "message_slot.h" // For BUF_LEN and MAX_BATCH
+
+#define DEFAULT_BATCH 64 // Messages per MSG_SLOT_BATCH call unless -b says otherwise
+
+typedef struct _StreamOptions {
+    unsigned long firstChannel; // First channel of the range
+    unsigned long channels;     // Number of channels in the range
+    int lengthDelimited;        // Messages are prefixed by a 4-byte length instead of ending in '\n'
+    unsigned int batch;         // Messages per call; 1 uses ioctl + read/write per message
+    unsigned long queueDepth;   // Sender: put every channel in queue mode with this depth (0: don't)
+    unsigned long limit;        // Reader: stop after this many messages (0: no limit)
+    int drain;                  // Reader: keep reading until a pass finds no message (queue mode)
+    const char *file;           // Sender: input file, NULL for stdin
+} StreamOptions;
+
+typedef struct _StreamStats {
+    double *latencies;         // Duration of every call, in microseconds
+    size_t calls;              // Number of calls recorded
+    size_t capacity;           // Allocated size of latencies
+    unsigned long messages;    // Messages moved
+    unsigned long bytes;       // Bytes moved
+    unsigned long misses;      // Messages dropped (sender) or empty reads (reader)
+    double start;              // Time the stream started, in microseconds
+} StreamStats;
+
+// Function to get a monotonic timestamp in microseconds
+static double nowUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// Function to parse "DEVICE --stream FIRST COUNT [options]". Options are -l (length-delimited),
+// -b BATCH, -q DEPTH (sender), -n MESSAGES and -d (reader) and a file name (sender). Returns 0 or -1
+static int parseStreamOptions(int c, char **args, StreamOptions *opts) {
+    char *end;
+    int i;
+    memset(opts, 0, sizeof(*opts));
+    opts->batch = DEFAULT_BATCH;
+    if (c < 5) return -1;
+    opts->firstChannel = strtoul(args[3], &end, 10);
+    if (*end != '\0' || opts->firstChannel == 0) return -1;
+    opts->channels = strtoul(args[4], &end, 10);
+    if (*end != '\0' || opts->channels == 0 || opts->firstChannel + opts->channels < opts->firstChannel) return -1;
+    for (i = 5; i < c; i++) {
+        if (strcmp(args[i], "-l") == 0) {
+            opts->lengthDelimited = 1;
+        } else if (strcmp(args[i], "-b") == 0 && i + 1 < c) {
+            opts->batch = strtoul(args[++i], &end, 10);
+            if (*end != '\0' || opts->batch == 0 || opts->batch > MAX_BATCH) return -1;
+        } else if (strcmp(args[i], "-q") == 0 && i + 1 < c) {
+            opts->queueDepth = strtoul(args[++i], &end, 10);
+            if (*end != '\0' || opts->queueDepth > MAX_QUEUE_DEPTH) return -1;
+        } else if (strcmp(args[i], "-d") == 0) {
+            opts->drain = 1;
+        } else if (strcmp(args[i], "-n") == 0 && i + 1 < c) {
+            opts->limit = strtoul(args[++i], &end, 10);
+            if (*end != '\0') return -1;
+        } else if (args[i][0] != '-' && opts->file == NULL) {
+            opts->file = args[i];
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to record how long one call took
+static void recordCall(StreamStats *stats, double us) {
+    double *grown;
+    if (stats->calls == stats->capacity) {
+        stats->capacity = stats->capacity == 0 ? 4096 : stats->capacity * 2;
+        if ((grown = realloc(stats->latencies, stats->capacity * sizeof(double))) == NULL) {
+            stats->capacity = stats->calls; // Out of memory: stop recording, keep counting
+            return;
+        }
+        stats->latencies = grown;
+    }
+    stats->latencies[stats->calls++] = us;
+}
+
+// qsort comparator for latencies
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Function to get the p-th percentile of sorted latencies
+static double percentile(const StreamStats *stats, double p) {
+    size_t index = (size_t) (p / 100.0 * (stats->calls - 1) + 0.5);
+    return stats->latencies[index < stats->calls ? index : stats->calls - 1];
+}
+
+// Function to print a summary of the stream to stderr
+static void reportStream(StreamStats *stats, const char *missName) {
+    double elapsed = (nowUs() - stats->start) / 1e6;
+    fprintf(stderr, "messages %lu  bytes %lu  %s %lu  elapsed %.3fs  msgs/s %.0f\n",
+            stats->messages, stats->bytes, missName, stats->misses, elapsed,
+            elapsed > 0 ? stats->messages / elapsed : 0);
+    if (stats->calls == 0) return;
+    qsort(stats->latencies, stats->calls, sizeof(double), compareDoubles);
+    fprintf(stderr, "calls %zu  latency_us p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            stats->calls, percentile(stats, 50), percentile(stats, 90), percentile(stats, 99),
+            percentile(stats, 99.9), stats->latencies[stats->calls - 1]);
+}
+
+#endif // MSGSLOT_MESSAGE_STREAM_H
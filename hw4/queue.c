@@ -1,200 +1,1631 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For syscall in <unistd.h>, which -D_POSIX_C_SOURCE alone hides
+#endif
 #include <threads.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "queue.h"
+#include "queue_trace.h"
+
+// Two implementations of a FIFO queue, selected at build time: the default one guards the queue
+// with a mutex, building with -DQUEUE_LOCKFREE selects a lock-free Michael-Scott queue instead.
+// Both take their nodes from the same pool. Sharded queues are built from several FIFO queues,
+// bounded queues keep their items in a preallocated ring instead
+
+#define CACHE_LINE 64
+
+// Pointers to queue nodes may carry a modification count in their unused top 16 bits, so a CAS
+// fails if the node was taken and reused in between (ABA)
+#define PTR_BITS 48
+#define PTR_MASK ((UINT64_C(1) << PTR_BITS) - 1)
+#define TAG_ONE (UINT64_C(1) << PTR_BITS)
+
+_Static_assert(sizeof(void*) == sizeof(uint64_t), "tagged pointers need 64-bit pointers");
+
+typedef uint64_t TaggedPtr;
 
 // Structure for each item in the queue
+#ifdef QUEUE_LOCKFREE
+typedef struct QueueItem {
+    _Atomic(void*) data;             // Read by dequeuers racing for the node, hence atomic
+    _Atomic TaggedPtr next;          // Next item in the queue
+    struct QueueItem* _Atomic poolNext; // Next free node in the pool
+} QueueItem;
+#else
 typedef struct QueueItem {
     void* data;
     struct QueueItem* next;
+    struct QueueItem* _Atomic poolNext; // Next free node in the pool
 } QueueItem;
+#endif
 
-// Structure for each thread waiting to dequeue
-typedef struct WaitingThread {
-    cnd_t cond;
-    struct WaitingThread* next;
-    bool isWaiting;
-} WaitingThread;
+// Get the node a tagged pointer points to
+static inline QueueItem* ptrOf(TaggedPtr tagged) {
+    return (QueueItem*)(uintptr_t)(tagged & PTR_MASK);
+}
+
+// Make a tagged pointer to node that replaces old, bumping old's modification count
+static inline TaggedPtr replace(TaggedPtr old, QueueItem* node) {
+    return ((old & ~PTR_MASK) + TAG_ONE) | (uintptr_t)node;
+}
+
+// Nodes come from a pool rather than malloc/free. Each thread keeps some free nodes of its own and
+// trades them in batches with a shared lock-free free list. The pool grows by slabs as large as all
+// earlier ones together, so it settles at the queue's high-water mark and steady-state operations do
+// not touch the heap. The pool is shared by all queues and its slabs are only freed along with the
+// last queue, which keeps nodes readable (type-stable) for the lock-free queue
+#define NODE_CACHE 64 // Free nodes a thread keeps before handing half of them back
+#define SLAB_MIN 256  // Nodes in the first slab
 
-// Structure for the queue itself
+// Structure for a block of nodes allocated at once
+typedef struct Slab {
+    struct Slab* next;
+    QueueItem nodes[];
+} Slab;
+
+// Structure for the free nodes of one thread
 typedef struct {
-    QueueItem* head;
-    QueueItem* tail;
-    size_t count;           // Current number of items in the queue
-    size_t visitedCount;    // Number of items that have passed through the queue
-    mtx_t mutex;            // Mutex for synchronization
-    WaitingThread* waitingHead; // Head of the waiting thread queue
-    WaitingThread* waitingTail; // Tail of the waiting thread queue
-    size_t waitingCount;    // Number of threads waiting for an item
-} Queue;
+    unsigned epoch;   // Pool incarnation the nodes belong to
+    size_t count;     // Number of nodes in the cache
+    QueueItem* head;  // Free nodes, linked through poolNext
+} NodeCache;
 
-Queue queue;
+// Structure for the node pool
+typedef struct {
+    alignas(CACHE_LINE) _Atomic TaggedPtr freeTop; // Shared free list
+    alignas(CACHE_LINE) atomic_uint epoch; // Bumped by init and destroy, so stale thread caches are dropped
+    mtx_t growMutex;  // Serializes adding slabs
+    Slab* slabs;      // All slabs, owning every node
+    size_t capacity;  // Number of nodes in all slabs
+    tss_t cacheKey;   // Hands a thread's cache back when the thread exits
+} NodePool;
 
-// Initialize the queue
-void initQueue(void) {
-    queue.head = NULL;
-    queue.tail = NULL;
-    queue.count = 0;
-    queue.visitedCount = 0;
-    queue.waitingHead = NULL;
-    queue.waitingTail = NULL;
-    queue.waitingCount = 0;
-    mtx_init(&queue.mutex, mtx_plain);
+static NodePool pool;
+static _Thread_local NodeCache nodeCache;
+static once_flag poolOnce = ONCE_FLAG_INIT;
+static mtx_t poolMutex;  // Guards poolUsers, and setting up and tearing down the pool
+static size_t poolUsers; // Number of live queues
+
+// Push a chain of free nodes, linked through poolNext, onto the shared free list
+static void pushFree(QueueItem* first, QueueItem* last) {
+    TaggedPtr top = atomic_load(&pool.freeTop);
+    do {
+        atomic_store_explicit(&last->poolNext, ptrOf(top), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&pool.freeTop, &top, replace(top, first)));
 }
 
-// Destroy the queue and free resources
-void destroyQueue(void) {
-    mtx_lock(&queue.mutex);
+// Pop a node from the shared free list, or NULL if it is empty
+static QueueItem* popFree(void) {
+    TaggedPtr top = atomic_load(&pool.freeTop);
+    QueueItem* node;
+    while ((node = ptrOf(top)) != NULL) {
+        QueueItem* next = atomic_load_explicit(&node->poolNext, memory_order_relaxed);
+        if (atomic_compare_exchange_weak(&pool.freeTop, &top, replace(top, next))) {
+            break;
+        }
+    }
+    return node;
+}
 
-    // Free all remaining items in the queue
-    while (queue.head != NULL) {
-        QueueItem* temp = queue.head;
-        queue.head = queue.head->next;
-        free(temp);
+// Put a node into a thread's cache
+static inline void cacheNode(NodeCache* cache, QueueItem* node) {
+    atomic_store_explicit(&node->poolNext, cache->head, memory_order_relaxed);
+    cache->head = node;
+    cache->count++;
+}
+
+// Hand a thread's cached nodes back to the shared free list (tss destructor, run on thread exit)
+static void flushCache(void* arg) {
+    NodeCache* cache = (NodeCache*)arg;
+    if (cache->head != NULL && cache->epoch == atomic_load(&pool.epoch)) {
+        QueueItem* last = cache->head;
+        QueueItem* next;
+        while ((next = atomic_load_explicit(&last->poolNext, memory_order_relaxed)) != NULL) {
+            last = next;
+        }
+        pushFree(cache->head, last);
+    }
+    cache->head = NULL;
+    cache->count = 0;
+}
+
+// Get the calling thread's cache, dropping its nodes if they belong to an earlier pool
+static NodeCache* threadCache(void) {
+    NodeCache* cache = &nodeCache;
+    unsigned epoch = atomic_load_explicit(&pool.epoch, memory_order_relaxed);
+    if (cache->epoch != epoch) {
+        cache->epoch = epoch;
+        cache->head = NULL;
+        cache->count = 0;
+        tss_set(pool.cacheKey, cache);
+    }
+    return cache;
+}
+
+// Add a slab to the pool, keeping some of its nodes in cache and sharing the rest. Returns false
+// if out of memory
+static bool growPool(NodeCache* cache) {
+    mtx_lock(&pool.growMutex);
+
+    // Another thread may have grown the pool while we waited
+    QueueItem* node = popFree();
+    if (node != NULL) {
+        mtx_unlock(&pool.growMutex);
+        cacheNode(cache, node);
+        return true;
+    }
+
+    size_t count = pool.capacity > SLAB_MIN ? pool.capacity : SLAB_MIN;
+    Slab* slab = (Slab*)calloc(1, sizeof(Slab) + count * sizeof(QueueItem));
+    if (slab == NULL && count > SLAB_MIN) {
+        count = SLAB_MIN; // Doubling failed; a small slab may still fit
+        slab = (Slab*)calloc(1, sizeof(Slab) + count * sizeof(QueueItem));
+    }
+    if (slab == NULL) {
+        mtx_unlock(&pool.growMutex);
+        return false;
+    }
+    slab->next = pool.slabs;
+    pool.slabs = slab;
+    pool.capacity += count;
+    mtx_unlock(&pool.growMutex);
+
+    size_t keep = NODE_CACHE / 2;
+    for (size_t i = 0; i < keep; i++) {
+        cacheNode(cache, &slab->nodes[i]);
     }
+    for (size_t i = keep; i + 1 < count; i++) {
+        atomic_store_explicit(&slab->nodes[i].poolNext, &slab->nodes[i + 1], memory_order_relaxed);
+    }
+    pushFree(&slab->nodes[keep], &slab->nodes[count - 1]);
+    return true;
+}
+
+// Take a free node, or NULL if out of memory
+static QueueItem* allocNode(void) {
+    NodeCache* cache = threadCache();
+    if (cache->head == NULL) {
+        QueueItem* node;
+        while (cache->count < NODE_CACHE / 2 && (node = popFree()) != NULL) {
+            cacheNode(cache, node);
+        }
+        if (cache->head == NULL && !growPool(cache)) {
+            return NULL;
+        }
+    }
+    QueueItem* node = cache->head;
+    cache->head = atomic_load_explicit(&node->poolNext, memory_order_relaxed);
+    cache->count--;
+    return node;
+}
+
+// Give back a node that left the queue. Once the cache is full, all but the most recently used
+// half goes to the shared free list
+static void freeNode(QueueItem* node) {
+    NodeCache* cache = threadCache();
+    cacheNode(cache, node);
+    if (cache->count > NODE_CACHE) {
+        QueueItem* keepLast = cache->head;
+        for (size_t i = 1; i < NODE_CACHE / 2; i++) {
+            keepLast = atomic_load_explicit(&keepLast->poolNext, memory_order_relaxed);
+        }
+        QueueItem* first = atomic_load_explicit(&keepLast->poolNext, memory_order_relaxed);
+        QueueItem* last = first;
+        QueueItem* next;
+        while ((next = atomic_load_explicit(&last->poolNext, memory_order_relaxed)) != NULL) {
+            last = next;
+        }
+        atomic_store_explicit(&keepLast->poolNext, NULL, memory_order_relaxed);
+        pushFree(first, last);
+        cache->count = NODE_CACHE / 2;
+    }
+}
 
-    // Free all waiting threads
-    while (queue.waitingHead != NULL) {
-        WaitingThread* temp = queue.waitingHead;
-        queue.waitingHead = queue.waitingHead->next;
-        cnd_destroy(&temp->cond);
+// Set up an empty pool
+static void poolInit(void) {
+    atomic_init(&pool.freeTop, 0);
+    atomic_fetch_add(&pool.epoch, 1);
+    pool.slabs = NULL;
+    pool.capacity = 0;
+    mtx_init(&pool.growMutex, mtx_plain);
+    tss_create(&pool.cacheKey, flushCache);
+}
+
+// Free every node, whether shared or cached by some thread
+static void poolDestroy(void) {
+    atomic_fetch_add(&pool.epoch, 1);
+    tss_delete(pool.cacheKey);
+    while (pool.slabs != NULL) {
+        Slab* temp = pool.slabs;
+        pool.slabs = pool.slabs->next;
         free(temp);
     }
+    pool.capacity = 0;
+    mtx_destroy(&pool.growMutex);
+}
 
-    mtx_unlock(&queue.mutex);
-    mtx_destroy(&queue.mutex);
+// Create poolMutex, once
+static void poolSetup(void) {
+    mtx_init(&poolMutex, mtx_plain);
 }
 
-// Enqueue an item into the queue
-void enqueue(void* item) {
-    QueueItem* newItem = (QueueItem*)malloc(sizeof(QueueItem));
-    newItem->data = item;
-    newItem->next = NULL;
+// Register a new queue with the pool, setting the pool up for the first one
+static void poolAcquire(void) {
+    call_once(&poolOnce, poolSetup);
+    mtx_lock(&poolMutex);
+    if (poolUsers++ == 0) {
+        poolInit();
+    }
+    mtx_unlock(&poolMutex);
+}
+
+// Unregister a destroyed queue, freeing all nodes along with the last one
+static void poolRelease(void) {
+    mtx_lock(&poolMutex);
+    if (--poolUsers == 0) {
+        poolDestroy();
+    }
+    mtx_unlock(&poolMutex);
+}
+
+// Waiting threads queue up as Waiter entries on their own stacks, in FIFO order, and are woken by
+// the thread that hands them an item (or room for one). A waiter first spins, then yields, and
+// only then sleeps on a futex, so short waits cost no system call. Each thread adapts its spin
+// budget: it grows when spinning paid off and shrinks when the thread had to sleep anyway
+#define SPIN_MIN 16      // Spin budget bounds, in CPU relax iterations
+#define SPIN_MAX 4096
+#define WAIT_YIELDS 2    // Yields between spinning and sleeping
+
+enum { WAITER_SPINNING, WAITER_SLEEPING, WAITER_DONE };
 
-    mtx_lock(&queue.mutex);
+// Structure for a waiting thread
+typedef struct Waiter {
+    atomic_uint state;   // WAITER_SPINNING, WAITER_SLEEPING once on the futex, WAITER_DONE when woken
+    struct Waiter* next;
+    void* item;          // Item handed to a consumer, or the item a producer waits to put
+} Waiter;
+
+static _Thread_local unsigned spinBudget = SPIN_MIN;
+
+// Tell the CPU we are busy-waiting
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Sleep while *word is expected, at most until deadline (TIME_UTC, NULL for none). Returns false on timeout
+static bool futexWait(atomic_uint* word, unsigned expected, const struct timespec* deadline) {
+    int op = FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | (deadline != NULL ? FUTEX_CLOCK_REALTIME : 0);
+    return syscall(SYS_futex, word, op, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0 || errno != ETIMEDOUT;
+}
+
+// Wake the thread sleeping on word, if any
+static void futexWake(atomic_uint* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+}
+
+// Append a waiter to a waiter queue
+static void pushWaiter(Waiter** head, Waiter** tail, Waiter* waiter) {
+    atomic_init(&waiter->state, WAITER_SPINNING);
+    waiter->next = NULL;
+    if (*tail == NULL) {
+        *head = waiter;
+    } else {
+        (*tail)->next = waiter;
+    }
+    *tail = waiter;
+}
+
+// Remove the oldest waiter from a non-empty waiter queue
+static Waiter* popWaiter(Waiter** head, Waiter** tail) {
+    Waiter* waiter = *head;
+    *head = waiter->next;
+    if (*head == NULL) {
+        *tail = NULL;
+    }
+    return waiter;
+}
 
-    if (queue.tail == NULL) {
-        queue.head = newItem;
+// Remove a waiter from wherever it is in a waiter queue
+static void removeWaiter(Waiter** head, Waiter** tail, Waiter* waiter) {
+    Waiter* prev = NULL;
+    Waiter* cur = *head;
+    while (cur != NULL && cur != waiter) {
+        prev = cur;
+        cur = cur->next;
+    }
+    if (cur == NULL) {
+        return;
+    }
+    if (prev == NULL) {
+        *head = waiter->next;
     } else {
-        queue.tail->next = newItem;
+        prev->next = waiter->next;
+    }
+    if (*tail == waiter) {
+        *tail = prev;
+    }
+}
+
+// Wake a waiter already removed from its queue. The waiter may return at once, so it must not be
+// touched afterwards (waking a futex it already left is harmless)
+static void wakeWaiter(Waiter* waiter) {
+    if (atomic_exchange_explicit(&waiter->state, WAITER_DONE, memory_order_acq_rel) == WAITER_SLEEPING) {
+        futexWake(&waiter->state);
     }
-    queue.tail = newItem;
-    queue.count++;
+}
 
-    // Debugging output
-    printf("Enqueued item: %d, total items in queue: %zu\n", *((int*)item), queue.count);
+// Wait until the waiter is woken or deadline (TIME_UTC, NULL for none) passes. Called with mutex,
+// which guards the waiter's queue, held and the waiter queued. If woken, returns true with mutex
+// released. On timeout returns false with mutex held, for the caller to take the waiter out
+static bool awaitWaiter(Waiter* waiter, mtx_t* mutex, const struct timespec* deadline) {
+    mtx_unlock(mutex);
 
-    // Wake up the first waiting thread, if any
-    if (queue.waitingHead != NULL) {
-        WaitingThread* waitingThread = queue.waitingHead;
-        queue.waitingHead = queue.waitingHead->next;
-        if (queue.waitingHead == NULL) {
-            queue.waitingTail = NULL;
+    unsigned budget = spinBudget;
+    for (unsigned i = 0; i < budget; i++) {
+        if (atomic_load_explicit(&waiter->state, memory_order_acquire) == WAITER_DONE) {
+            spinBudget = budget * 2 < SPIN_MAX ? budget * 2 : SPIN_MAX;
+            return true;
+        }
+        cpuRelax();
+    }
+    for (int i = 0; i < WAIT_YIELDS; i++) {
+        thrd_yield();
+        if (atomic_load_explicit(&waiter->state, memory_order_acquire) == WAITER_DONE) {
+            return true;
         }
-        queue.waitingCount--;
-        waitingThread->isWaiting = false; // Mark thread as ready to proceed
-        cnd_signal(&waitingThread->cond);
     }
+    spinBudget = budget / 2 > SPIN_MIN ? budget / 2 : SPIN_MIN;
 
-    mtx_unlock(&queue.mutex);
+    unsigned expected = WAITER_SPINNING;
+    if (!atomic_compare_exchange_strong(&waiter->state, &expected, WAITER_SLEEPING)) {
+        atomic_thread_fence(memory_order_acquire);
+        return true; // Woken meanwhile
+    }
+    while (atomic_load_explicit(&waiter->state, memory_order_acquire) == WAITER_SLEEPING) {
+        if (!futexWait(&waiter->state, WAITER_SLEEPING, deadline)) {
+            // Timed out, unless a waker got in first: only it changes the state, with mutex held
+            mtx_lock(mutex);
+            if (atomic_load_explicit(&waiter->state, memory_order_acquire) == WAITER_DONE) {
+                mtx_unlock(mutex);
+                return true;
+            }
+            return false;
+        }
+    }
+    return true;
 }
 
-// Dequeue an item from the queue (blocks if empty)
-void* dequeue(void) {
-    mtx_lock(&queue.mutex);
+typedef struct ShardSet ShardSet;
+typedef struct Ring Ring;
+
+#ifdef QUEUE_LOCKFREE
+
+// Structure for the queue itself. Dequeuers work on head, enqueuers on tail, each on its own cache line
+struct Queue {
+    alignas(CACHE_LINE) _Atomic TaggedPtr head; // Dummy node; the first item is head's next
+    atomic_size_t visitedCount;  // Number of items that have passed through the queue
+    alignas(CACHE_LINE) _Atomic TaggedPtr tail; // Last node, or lagging one behind it
+    atomic_size_t enqueuedCount; // Number of items ever enqueued
+    alignas(CACHE_LINE) atomic_size_t waitingCount; // Number of threads waiting for an item
+    mtx_t waitMutex;            // Guards the waiting thread queue, only taken to park or wake
+    Waiter* waitingHead;        // Head of the waiting thread queue
+    Waiter* waitingTail;        // Tail of the waiting thread queue
+    ShardSet* sharded;          // Shards holding the items of a sharded queue, NULL otherwise
+    Ring* bounded;              // Ring holding the items of a bounded queue, NULL otherwise
+};
 
-    // If the queue is empty, add the current thread to the waiting queue
-    while (queue.count == 0) {
-        WaitingThread myWaitingThread;
-        cnd_init(&myWaitingThread.cond);
-        myWaitingThread.next = NULL;
-        myWaitingThread.isWaiting = true;
+static size_t fifoSize(Queue* q);
 
-        if (queue.waitingTail == NULL) {
-            queue.waitingHead = &myWaitingThread;
+// Create an empty queue. Returns NULL if out of memory
+static Queue* fifoCreate(void) {
+    Queue* q = (Queue*)aligned_alloc(CACHE_LINE, sizeof(Queue));
+    if (q == NULL) {
+        return NULL;
+    }
+    poolAcquire();
+    QueueItem* dummy = allocNode();
+    if (dummy == NULL) {
+        poolRelease();
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->head, (TaggedPtr)(uintptr_t)dummy);
+    atomic_init(&q->tail, (TaggedPtr)(uintptr_t)dummy);
+    atomic_init(&q->visitedCount, 0);
+    atomic_init(&q->enqueuedCount, 0);
+    atomic_init(&q->waitingCount, 0);
+    q->waitingHead = NULL;
+    q->waitingTail = NULL;
+    q->sharded = NULL;
+    q->bounded = NULL;
+    mtx_init(&q->waitMutex, mtx_plain);
+    return q;
+}
+
+// Destroy a queue and free resources. No other thread may use the queue anymore
+static void fifoDestroy(Queue* q) {
+    QueueItem* node = ptrOf(atomic_load(&q->head));
+    while (node != NULL) {
+        QueueItem* next = ptrOf(atomic_load(&node->next));
+        freeNode(node);
+        node = next;
+    }
+    mtx_destroy(&q->waitMutex); // Waiting thread entries live on their threads' stacks
+    free(q);
+    poolRelease();
+}
+
+// Link a chain of count nodes, first to last, after the last node
+static void linkItems(Queue* q, QueueItem* first, QueueItem* last, size_t count) {
+    TaggedPtr tail, next;
+    for (;;) {
+        tail = atomic_load(&q->tail);
+        next = atomic_load(&ptrOf(tail)->next);
+        if (tail != atomic_load(&q->tail)) {
+            continue; // tail moved while we read its next
+        }
+        if (ptrOf(next) == NULL) {
+            if (atomic_compare_exchange_weak(&ptrOf(tail)->next, &next, replace(next, first))) {
+                break; // Linked; the items are in the queue
+            }
         } else {
-            queue.waitingTail->next = &myWaitingThread;
+            atomic_compare_exchange_weak(&q->tail, &tail, replace(tail, ptrOf(next))); // Help a lagging tail
         }
-        queue.waitingTail = &myWaitingThread;
-        queue.waitingCount++;
+    }
+    atomic_compare_exchange_strong(&q->tail, &tail, replace(tail, last)); // Fails if someone helped
+    atomic_fetch_add_explicit(&q->enqueuedCount, count, memory_order_relaxed);
+}
+
+// Take a node for item, not yet linked to anything. Returns NULL if out of memory
+static QueueItem* makeItem(void* item) {
+    QueueItem* node = allocNode();
+    if (node == NULL) {
+        return NULL;
+    }
+    atomic_store_explicit(&node->data, item, memory_order_relaxed);
+    atomic_store(&node->next, replace(atomic_load(&node->next), NULL));
+    return node;
+}
+
+// Unlink the first item, if any
+static bool popItem(Queue* q, void** item) {
+    TaggedPtr head, tail, next;
+    for (;;) {
+        head = atomic_load(&q->head);
+        tail = atomic_load(&q->tail);
+        next = atomic_load(&ptrOf(head)->next);
+        if (head != atomic_load(&q->head)) {
+            continue; // head moved while we read its next
+        }
+        if (ptrOf(head) == ptrOf(tail)) {
+            if (ptrOf(next) == NULL) {
+                return false; // Really empty
+            }
+            atomic_compare_exchange_weak(&q->tail, &tail, replace(tail, ptrOf(next))); // Help a lagging tail
+            continue;
+        }
+        *item = atomic_load_explicit(&ptrOf(next)->data, memory_order_relaxed); // Before next can be reused
+        if (atomic_compare_exchange_weak(&q->head, &head, replace(head, ptrOf(next)))) {
+            freeNode(ptrOf(head)); // next is the new dummy
+            atomic_fetch_add_explicit(&q->visitedCount, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+}
 
-        // Debugging output
-        printf("Thread %lx waiting for item...\n", thrd_current());
+// Unlink up to max items from the front with a single CAS on head. Returns how many
+static size_t popItems(Queue* q, void** items, size_t max) {
+    TaggedPtr head, tail, next;
+    if (max == 1) {
+        return popItem(q, items);
+    }
+    for (;;) {
+        head = atomic_load(&q->head);
 
-        // Wait for a signal
-        while (myWaitingThread.isWaiting) {
-            cnd_wait(&myWaitingThread.cond, &queue.mutex);
+        // Bring tail to the last node first. Unlinked nodes then all lie before it, so head never
+        // passes tail
+        for (;;) {
+            tail = atomic_load(&q->tail);
+            next = atomic_load(&ptrOf(tail)->next);
+            if (tail != atomic_load(&q->tail)) {
+                continue;
+            }
+            if (ptrOf(next) == NULL) {
+                break;
+            }
+            atomic_compare_exchange_weak(&q->tail, &tail, replace(tail, ptrOf(next)));
+        }
+        if (head != atomic_load(&q->head)) {
+            continue; // head moved, so tail may not be behind it anymore
         }
 
-        // After being signaled, remove the thread from the queue
-        if (queue.waitingHead == &myWaitingThread) {
-            queue.waitingHead = myWaitingThread.next;
+        QueueItem* last = ptrOf(head); // The new dummy
+        size_t count = 0;
+        while (count < max && last != ptrOf(tail)) {
+            QueueItem* node = ptrOf(atomic_load(&last->next));
+            if (node == NULL) {
+                break; // head was taken and its node reused meanwhile, so head has moved
+            }
+            items[count++] = atomic_load_explicit(&node->data, memory_order_relaxed);
+            last = node;
+        }
+        if (count == 0) {
+            if (head != atomic_load(&q->head)) {
+                continue; // The walk hit a reused node; the queue may well hold items
+            }
+            return 0; // Really empty
+        }
+        if (atomic_compare_exchange_weak(&q->head, &head, replace(head, last))) {
+            QueueItem* node = ptrOf(head);
+            while (node != last) {
+                QueueItem* following = ptrOf(atomic_load(&node->next));
+                freeNode(node);
+                node = following;
+            }
+            atomic_fetch_add_explicit(&q->visitedCount, count, memory_order_relaxed);
+            return count;
+        }
+    }
+}
+
+// Wake up to count waiting threads, oldest first. A waiter registers before its last look at the
+// queue, so either it sees the new items or we see it (both sides use sequentially consistent atomics)
+static void wakeWaiters(Queue* q, size_t count) {
+    if (atomic_load(&q->waitingCount) == 0) {
+        return;
+    }
+    size_t woken = 0;
+    mtx_lock(&q->waitMutex);
+    while (woken < count && q->waitingHead != NULL) {
+        Waiter* waiter = popWaiter(&q->waitingHead, &q->waitingTail);
+        atomic_fetch_sub(&q->waitingCount, 1);
+        wakeWaiter(waiter);
+        woken++;
+    }
+    mtx_unlock(&q->waitMutex);
+    TRACE(TRACE_WAKE, NULL, woken);
+}
+
+// Dequeue between 1 and max items, waiting while the queue is empty. Returns how many, or 0 if
+// deadline (TIME_UTC, NULL for none) passed first
+static size_t awaitItems(Queue* q, void** items, size_t max, const struct timespec* deadline) {
+    size_t count = popItems(q, items, max);
+    if (count > 0) {
+        return count; // Fast path, no lock taken
+    }
+
+    for (;;) {
+        Waiter me;
+        mtx_lock(&q->waitMutex);
+        pushWaiter(&q->waitingHead, &q->waitingTail, &me);
+        atomic_fetch_add(&q->waitingCount, 1);
+        TRACE(TRACE_WAIT, NULL, atomic_load(&q->waitingCount));
+
+        // Only wait if the queue is still empty now that enqueuers can see us
+        if ((count = popItems(q, items, max)) > 0) {
+            removeWaiter(&q->waitingHead, &q->waitingTail, &me);
+            atomic_fetch_sub(&q->waitingCount, 1);
+            mtx_unlock(&q->waitMutex);
+            return count;
+        }
+        if (!awaitWaiter(&me, &q->waitMutex, deadline)) {
+            removeWaiter(&q->waitingHead, &q->waitingTail, &me);
+            atomic_fetch_sub(&q->waitingCount, 1);
+            mtx_unlock(&q->waitMutex);
+            return popItems(q, items, max); // Timed out; take anything that arrived meanwhile
+        }
+        // The enqueuer already removed us from the waiting queue
+        if ((count = popItems(q, items, max)) > 0) {
+            return count;
         }
-        if (queue.waitingTail == &myWaitingThread) {
-            queue.waitingTail = NULL;
+        // Another thread took the items first; wait again
+    }
+}
+
+// Enqueue an item into the queue. Returns false if out of memory
+static bool fifoEnqueue(Queue* q, void* item) {
+    QueueItem* node = makeItem(item);
+    if (node == NULL) {
+        return false;
+    }
+    linkItems(q, node, node, 1);
+    TRACE(TRACE_ENQUEUE, item, fifoSize(q));
+    wakeWaiters(q, 1);
+    return true;
+}
+
+// Enqueue n items at once, in order, with a single link into the queue. Returns false, with
+// nothing enqueued, if out of memory
+static bool fifoEnqueueBatch(Queue* q, void** items, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    QueueItem* first = makeItem(items[0]);
+    if (first == NULL) {
+        return false;
+    }
+    QueueItem* last = first;
+    for (size_t i = 1; i < n; i++) {
+        QueueItem* node = makeItem(items[i]);
+        if (node == NULL) {
+            while (first != NULL) { // The chain ends at last, whose next is still NULL
+                QueueItem* next = ptrOf(atomic_load(&first->next));
+                freeNode(first);
+                first = next;
+            }
+            return false;
         }
-        cnd_destroy(&myWaitingThread.cond);
+        atomic_store(&last->next, replace(atomic_load(&last->next), node));
+        last = node;
+    }
+    linkItems(q, first, last, n);
+    TRACE(TRACE_ENQUEUE_BATCH, items[0], n);
+    wakeWaiters(q, n);
+    return true;
+}
+
+// Dequeue an item from the queue (blocks if empty)
+static void* fifoDequeue(Queue* q) {
+    void* data;
+    awaitItems(q, &data, 1, NULL);
+    TRACE(TRACE_DEQUEUE, data, fifoSize(q));
+    return data;
+}
+
+// Dequeue an item, waiting no later than deadline (TIME_UTC, NULL for none). Returns false on timeout
+static bool fifoDequeueTimeout(Queue* q, void** item, const struct timespec* deadline) {
+    bool found = awaitItems(q, item, 1, deadline) > 0;
+    TRACE(TRACE_DEQUEUE, found ? *item : NULL, fifoSize(q));
+    return found;
+}
+
+// Dequeue up to max items, blocking until there is at least one. Returns how many
+static size_t fifoDequeueBatch(Queue* q, void** items, size_t max) {
+    if (max == 0) {
+        return 0;
+    }
+    size_t count = awaitItems(q, items, max, NULL);
+    TRACE(TRACE_DEQUEUE_BATCH, items[0], count);
+    return count;
+}
+
+// Try to dequeue an item from the queue without blocking
+static bool fifoTryDequeue(Queue* q, void** item) {
+    bool found = popItem(q, item);
+    TRACE(TRACE_TRY_DEQUEUE, found ? *item : NULL, fifoSize(q));
+    return found;
+}
+
+// Try to dequeue up to max items without blocking. Returns how many
+static size_t fifoTryDequeueBatch(Queue* q, void** items, size_t max) {
+    size_t count = max == 0 ? 0 : popItems(q, items, max);
+    TRACE(TRACE_DEQUEUE_BATCH, count > 0 ? items[0] : NULL, count);
+    return count;
+}
+
+// Get the current number of items in the queue
+static size_t fifoSize(Queue* q) {
+    size_t visited = atomic_load(&q->visitedCount);
+    size_t enqueued = atomic_load(&q->enqueuedCount);
+    return enqueued > visited ? enqueued - visited : 0; // A dequeue may be counted before its enqueue
+}
+
+// Get the total number of items that have passed through the queue
+static size_t fifoVisited(Queue* q) {
+    return atomic_load(&q->visitedCount);
+}
+
+// Get the current number of threads waiting for an item
+static size_t fifoWaiting(Queue* q) {
+    return atomic_load(&q->waitingCount);
+}
+
+#else // Mutex implementation
+
+// Free count nodes chained from node
+static void freeNodes(QueueItem* node, size_t count) {
+    while (count-- > 0) {
+        QueueItem* next = node->next;
+        freeNode(node);
+        node = next;
+    }
+}
+
+// Structure for the queue itself. The mutex and what every operation touches share a cache line;
+// the tail, written by enqueuers, and the head, written by dequeuers, have their own
+struct Queue {
+    alignas(CACHE_LINE) mtx_t mutex; // Mutex for synchronization
+    size_t count;           // Current number of items in the queue
+    Waiter* waitingHead;    // Head of the waiting thread queue
+    Waiter* waitingTail;    // Tail of the waiting thread queue
+    size_t waitingCount;    // Number of threads waiting for an item
+    ShardSet* sharded;      // Shards holding the items of a sharded queue, NULL otherwise
+    Ring* bounded;          // Ring holding the items of a bounded queue, NULL otherwise
+    alignas(CACHE_LINE) QueueItem* tail;
+    alignas(CACHE_LINE) QueueItem* head;
+    size_t visitedCount;    // Number of items that have passed through the queue
+};
+
+// Create an empty queue. Returns NULL if out of memory
+static Queue* fifoCreate(void) {
+    Queue* q = (Queue*)aligned_alloc(CACHE_LINE, sizeof(Queue));
+    if (q == NULL) {
+        return NULL;
+    }
+    poolAcquire();
+    q->head = NULL;
+    q->tail = NULL;
+    q->count = 0;
+    q->visitedCount = 0;
+    q->waitingHead = NULL;
+    q->waitingTail = NULL;
+    q->waitingCount = 0;
+    q->sharded = NULL;
+    q->bounded = NULL;
+    mtx_init(&q->mutex, mtx_plain);
+    return q;
+}
+
+// Destroy a queue and free resources. No other thread may use the queue anymore
+static void fifoDestroy(Queue* q) {
+    mtx_lock(&q->mutex);
+
+    // Give all remaining items back to the pool
+    freeNodes(q->head, q->count);
+    q->head = NULL;
+    q->tail = NULL;
+
+    // Waiting thread entries live on their threads' stacks
+    q->waitingHead = NULL;
+    q->waitingTail = NULL;
+
+    mtx_unlock(&q->mutex);
+    mtx_destroy(&q->mutex);
+    free(q);
+    poolRelease();
+}
+
+// Hand an item straight to the oldest waiting thread, which means the queue is empty. Called with the mutex held
+static void handOver(Queue* q, void* item) {
+    Waiter* waiter = popWaiter(&q->waitingHead, &q->waitingTail);
+    q->waitingCount--;
+    q->visitedCount++;
+    waiter->item = item;
+    wakeWaiter(waiter);
+    TRACE(TRACE_HANDOVER, item, 0);
+}
+
+// Wait in line until an enqueuer hands us an item or deadline (TIME_UTC, NULL for none) passes.
+// Called with the mutex held and the queue empty. Returns true with the item in *item and the
+// mutex released, or false on timeout with the mutex still held
+static bool awaitItem(Queue* q, void** item, const struct timespec* deadline) {
+    Waiter me;
+    pushWaiter(&q->waitingHead, &q->waitingTail, &me);
+    q->waitingCount++;
+
+    TRACE(TRACE_WAIT, NULL, q->waitingCount);
+
+    // If woken, the enqueuer already removed us from the waiting queue
+    if (!awaitWaiter(&me, &q->mutex, deadline)) {
+        removeWaiter(&q->waitingHead, &q->waitingTail, &me);
+        q->waitingCount--;
+        return false;
+    }
+    *item = me.item;
+    return true;
+}
+
+// Unlink up to max items from the front of the queue. Called with the mutex held. Returns how many;
+// their nodes stay chained from *nodes so they can be freed after unlocking
+static size_t takeItems(Queue* q, void** items, size_t max, QueueItem** nodes) {
+    QueueItem* node = q->head;
+    size_t count = 0;
+    *nodes = node;
+    while (count < max && node != NULL) {
+        items[count++] = node->data;
+        node = node->next;
+    }
+    q->head = node;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->count -= count;
+    q->visitedCount += count;
+    return count;
+}
+
+// Enqueue an item into the queue. Returns false if out of memory
+static bool fifoEnqueue(Queue* q, void* item) {
+    mtx_lock(&q->mutex);
+
+    // Waiting threads mean the queue is empty: the first one gets the item directly, no node needed
+    if (q->waitingHead != NULL) {
+        handOver(q, item);
+        mtx_unlock(&q->mutex);
+        return true;
+    }
+
+    // Usually served from the thread's own node cache, so cheap to do under the lock
+    QueueItem* newItem = allocNode();
+    if (newItem == NULL) {
+        mtx_unlock(&q->mutex);
+        return false;
+    }
+    newItem->data = item;
+    newItem->next = NULL;
+
+    if (q->tail == NULL) {
+        q->head = newItem;
+    } else {
+        q->tail->next = newItem;
+    }
+    q->tail = newItem;
+    q->count++;
+
+    TRACE(TRACE_ENQUEUE, item, q->count);
+
+    mtx_unlock(&q->mutex);
+    return true;
+}
+
+// Enqueue n items at once, in order. Waiting threads get the first items, oldest thread first, and
+// the rest are spliced into the queue as one chain. Returns false, with nothing enqueued, if out of memory
+static bool fifoEnqueueBatch(Queue* q, void** items, size_t n) {
+    QueueItem* first = NULL;
+    QueueItem* last = NULL;
+    if (n == 0) {
+        return true;
+    }
+
+    // Chain nodes for all items before taking the lock
+    for (size_t i = 0; i < n; i++) {
+        QueueItem* newItem = allocNode();
+        if (newItem == NULL) {
+            freeNodes(first, i);
+            return false;
+        }
+        newItem->data = items[i];
+        newItem->next = NULL;
+        if (last == NULL) {
+            first = newItem;
+        } else {
+            last->next = newItem;
+        }
+        last = newItem;
+    }
+
+    mtx_lock(&q->mutex);
+
+    size_t handed = 0;
+    QueueItem* rest = first;
+    while (rest != NULL && q->waitingHead != NULL) {
+        handOver(q, rest->data);
+        rest = rest->next;
+        handed++;
+    }
+    if (rest != NULL) {
+        if (q->tail == NULL) {
+            q->head = rest;
+        } else {
+            q->tail->next = rest;
+        }
+        q->tail = last;
+        q->count += n - handed;
+    }
+    TRACE(TRACE_ENQUEUE_BATCH, items[0], n);
+
+    mtx_unlock(&q->mutex);
+    freeNodes(first, handed);
+    return true;
+}
+
+// Dequeue an item from the queue (blocks if empty)
+static void* fifoDequeue(Queue* q) {
+    mtx_lock(&q->mutex);
+
+    // If the queue is empty, wait in line for an enqueuer to hand us an item
+    if (q->count == 0) {
+        void* data;
+        awaitItem(q, &data, NULL);
+        TRACE(TRACE_DEQUEUE, data, 0);
+        return data;
     }
 
     // Remove the item from the front of the queue
-    QueueItem* item = queue.head;
-    queue.head = item->next;
-    if (queue.head == NULL) {
-        queue.tail = NULL;
+    QueueItem* item = q->head;
+    q->head = item->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
     }
-    queue.count--;
-    queue.visitedCount++;
+    q->count--;
+    q->visitedCount++;
 
-    // Debugging output
-    printf("Thread %lx dequeued item %d\n", thrd_current(), *((int*)item->data));
+    TRACE(TRACE_DEQUEUE, item->data, q->count);
 
     void* data = item->data;
-    free(item);
 
-    mtx_unlock(&queue.mutex);
+    mtx_unlock(&q->mutex);
+    freeNode(item);
 
     return data;
 }
 
+// Dequeue up to max items, blocking until there is at least one. Returns how many
+static size_t fifoDequeueBatch(Queue* q, void** items, size_t max) {
+    QueueItem* nodes;
+    size_t handed = 0;
+    if (max == 0) {
+        return 0;
+    }
+
+    mtx_lock(&q->mutex);
+    if (q->count == 0) {
+        awaitItem(q, &items[handed++], NULL);
+        mtx_lock(&q->mutex); // Take items a batch enqueue put behind ours
+    }
+    size_t count = takeItems(q, items + handed, max - handed, &nodes);
+    TRACE(TRACE_DEQUEUE_BATCH, items[0], handed + count);
+    mtx_unlock(&q->mutex);
+
+    freeNodes(nodes, count);
+    return handed + count;
+}
+
+// Dequeue an item, waiting no later than deadline (TIME_UTC, NULL for none). Returns false on timeout
+static bool fifoDequeueTimeout(Queue* q, void** item, const struct timespec* deadline) {
+    mtx_lock(&q->mutex);
+    if (q->count == 0) {
+        bool found = awaitItem(q, item, deadline);
+        if (!found) {
+            mtx_unlock(&q->mutex);
+        }
+        TRACE(TRACE_DEQUEUE, found ? *item : NULL, 0);
+        return found;
+    }
+
+    QueueItem* dequeuedItem = q->head;
+    q->head = dequeuedItem->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->count--;
+    q->visitedCount++;
+    *item = dequeuedItem->data;
+    TRACE(TRACE_DEQUEUE, *item, q->count);
+
+    mtx_unlock(&q->mutex);
+    freeNode(dequeuedItem);
+    return true;
+}
+
 // Try to dequeue an item from the queue without blocking
-bool tryDequeue(void** item) {
-    mtx_lock(&queue.mutex);
+static bool fifoTryDequeue(Queue* q, void** item) {
+    mtx_lock(&q->mutex);
 
-    if (queue.count == 0) {
-        mtx_unlock(&queue.mutex);
+    if (q->count == 0) {
+        TRACE(TRACE_TRY_DEQUEUE, NULL, 0);
+        mtx_unlock(&q->mutex);
         return false;
     }
 
     // Remove the item from the front of the queue
-    QueueItem* dequeuedItem = queue.head;
-    queue.head = dequeuedItem->next;
-    if (queue.head == NULL) {
-        queue.tail = NULL;
+    QueueItem* dequeuedItem = q->head;
+    q->head = dequeuedItem->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
     }
-    queue.count--;
-    queue.visitedCount++;
+    q->count--;
+    q->visitedCount++;
 
     *item = dequeuedItem->data;
-    free(dequeuedItem);
 
-    // Debugging output
-    printf("TryDequeued item: %d, total items left in queue: %zu\n", *((int*)*item), queue.count);
+    TRACE(TRACE_TRY_DEQUEUE, *item, q->count);
+
+    mtx_unlock(&q->mutex);
+    freeNode(dequeuedItem);
+    return true;
+}
+
+// Try to dequeue up to max items without blocking. Returns how many
+static size_t fifoTryDequeueBatch(Queue* q, void** items, size_t max) {
+    QueueItem* nodes;
+    mtx_lock(&q->mutex);
+    size_t count = takeItems(q, items, max, &nodes);
+    TRACE(TRACE_DEQUEUE_BATCH, count > 0 ? items[0] : NULL, count);
+    mtx_unlock(&q->mutex);
+    freeNodes(nodes, count);
+    return count;
+}
+
+// Get the current number of items in the queue
+static size_t fifoSize(Queue* q) {
+    return q->count;
+}
+
+// Get the total number of items that have passed through the queue
+static size_t fifoVisited(Queue* q) {
+    return q->visitedCount;
+}
+
+// Get the current number of threads waiting for an item
+static size_t fifoWaiting(Queue* q) {
+    return q->waitingCount;
+}
+
+#endif // QUEUE_LOCKFREE
+
+// A sharded queue gives up global FIFO order for throughput. Each thread enqueues into its own
+// shard, a FIFO queue, and dequeues from it first, stealing from the other shards when it is
+// empty. Threads park only when all shards are empty, in a FIFO of their own; the shards never block
+
+// Structure for the shards of a sharded queue
+struct ShardSet {
+    size_t count;            // Number of shards
+    Queue** shards;
+    alignas(CACHE_LINE) atomic_size_t waitingCount; // Number of parked threads
+    mtx_t parkMutex;         // Guards the parked thread queue, only taken to park or wake
+    Waiter* parkedHead;      // Head of the parked thread queue
+    Waiter* parkedTail;      // Tail of the parked thread queue
+};
+
+static atomic_size_t nextShard;        // Hands out home shards to threads
+static _Thread_local size_t homeShard; // This thread's shard number + 1, 0 until it has one
+
+// Get the calling thread's shard of set
+static size_t shardOf(ShardSet* set) {
+    if (homeShard == 0) {
+        homeShard = atomic_fetch_add_explicit(&nextShard, 1, memory_order_relaxed) + 1;
+    }
+    return (homeShard - 1) % set->count;
+}
+
+// Take up to max items: from the thread's own shard if it has any, else from the first other
+// shard that does. Returns how many
+static size_t takeShards(ShardSet* set, void** items, size_t max) {
+    size_t home = shardOf(set);
+    for (size_t i = 0; i < set->count; i++) {
+        Queue* shard = set->shards[(home + i) % set->count];
+        size_t count = max == 1 ? fifoTryDequeue(shard, items) : fifoTryDequeueBatch(shard, items, max);
+        if (count > 0) {
+            return count;
+        }
+    }
+    return 0;
+}
+
+// Wake up to count parked threads, oldest first. Parking threads register before their last look
+// at the shards, so either they see the new items or we see them
+static void wakeParked(ShardSet* set, size_t count) {
+    if (atomic_load(&set->waitingCount) == 0) {
+        return;
+    }
+    mtx_lock(&set->parkMutex);
+    while (count-- > 0 && set->parkedHead != NULL) {
+        Waiter* parked = popWaiter(&set->parkedHead, &set->parkedTail);
+        atomic_fetch_sub(&set->waitingCount, 1);
+        wakeWaiter(parked);
+    }
+    mtx_unlock(&set->parkMutex);
+}
+
+// Dequeue between 1 and max items, parking while all shards are empty. Returns how many, or 0 if
+// deadline (TIME_UTC, NULL for none) passed first
+static size_t awaitShards(ShardSet* set, void** items, size_t max, const struct timespec* deadline) {
+    size_t count = takeShards(set, items, max);
+    if (count > 0) {
+        return count;
+    }
+
+    for (;;) {
+        Waiter me;
+        mtx_lock(&set->parkMutex);
+        pushWaiter(&set->parkedHead, &set->parkedTail, &me);
+        atomic_fetch_add(&set->waitingCount, 1);
+        TRACE(TRACE_WAIT, NULL, atomic_load(&set->waitingCount));
+
+        // Only park if all shards are still empty now that enqueuers can see us
+        if ((count = takeShards(set, items, max)) > 0) {
+            removeWaiter(&set->parkedHead, &set->parkedTail, &me);
+            atomic_fetch_sub(&set->waitingCount, 1);
+            mtx_unlock(&set->parkMutex);
+            return count;
+        }
+        if (!awaitWaiter(&me, &set->parkMutex, deadline)) {
+            removeWaiter(&set->parkedHead, &set->parkedTail, &me);
+            atomic_fetch_sub(&set->waitingCount, 1);
+            mtx_unlock(&set->parkMutex);
+            return takeShards(set, items, max); // Timed out; take anything that arrived meanwhile
+        }
+        // The enqueuer already removed us from the parked queue
+        if ((count = takeShards(set, items, max)) > 0) {
+            return count;
+        }
+        // Another thread took the items first; park again
+    }
+}
+
+// Free the shards of a sharded queue
+static void destroyShards(ShardSet* set) {
+    for (size_t i = 0; i < set->count; i++) {
+        fifoDestroy(set->shards[i]);
+    }
+    mtx_destroy(&set->parkMutex);
+    free(set->shards);
+    free(set);
+}
+
+// A bounded queue keeps up to capacity items in a ring allocated up front, so memory stays flat
+// however far producers run ahead. It is guarded by a mutex and hands items over directly in both
+// directions: an enqueue gives its item to the oldest waiting consumer, and a dequeue from a full
+// ring moves the oldest blocked producer's item into the slot it freed. Consumers and producers
+// are thus served in FIFO order, and a waiting thread never has to compete for its turn again
+
+// Structure for the ring of a bounded queue
+struct Ring {
+    alignas(CACHE_LINE) mtx_t mutex; // Mutex for synchronization
+    size_t first;           // Slot of the first item
+    size_t count;           // Current number of items in the ring
+    size_t visitedCount;    // Number of items that have passed through the queue
+    Waiter* consumersHead;  // Threads waiting for an item, oldest first
+    Waiter* consumersTail;
+    size_t waitingCount;    // Number of threads waiting for an item
+    Waiter* producersHead;  // Threads waiting for room, oldest first
+    Waiter* producersTail;
+    size_t capacity;        // Number of slots
+    void** slots;
+};
+
+// Put an item in the ring, waiting for room if block is set. Called with the mutex held. Returns
+// false if the ring is full and block is not set
+static bool ringPut(Ring* ring, void* item, bool block) {
+    if (ring->consumersHead != NULL) {
+        // Waiting consumers mean the ring is empty: the first one gets the item directly
+        Waiter* consumer = popWaiter(&ring->consumersHead, &ring->consumersTail);
+        ring->waitingCount--;
+        ring->visitedCount++;
+        consumer->item = item;
+        wakeWaiter(consumer);
+        TRACE(TRACE_HANDOVER, item, 0);
+        return true;
+    }
+    if (ring->count < ring->capacity) {
+        ring->slots[(ring->first + ring->count) % ring->capacity] = item;
+        ring->count++;
+        TRACE(TRACE_ENQUEUE, item, ring->count);
+        return true;
+    }
+    if (!block) {
+        return false;
+    }
+    Waiter me;
+    pushWaiter(&ring->producersHead, &ring->producersTail, &me);
+    me.item = item;
+    TRACE(TRACE_WAIT, item, ring->capacity);
+    awaitWaiter(&me, &ring->mutex, NULL); // A consumer puts our item
+    mtx_lock(&ring->mutex);
+    return true;
+}
+
+// Take up to max items from the ring. Called with the mutex held. Returns how many
+static size_t ringTake(Ring* ring, void** items, size_t max) {
+    size_t count = 0;
+    while (count < max && ring->count > 0) {
+        items[count++] = ring->slots[ring->first];
+        ring->first = (ring->first + 1) % ring->capacity;
+        ring->count--;
+
+        // Room for the oldest blocked producer's item, behind the ones already in the ring
+        if (ring->producersHead != NULL) {
+            Waiter* producer = popWaiter(&ring->producersHead, &ring->producersTail);
+            ring->slots[(ring->first + ring->count) % ring->capacity] = producer->item;
+            ring->count++;
+            wakeWaiter(producer);
+        }
+    }
+    ring->visitedCount += count;
+    return count;
+}
+
+// Dequeue between 1 and max items from the ring, waiting while it is empty. Returns how many, or
+// 0 if deadline (TIME_UTC, NULL for none) passed first
+static size_t ringAwait(Ring* ring, void** items, size_t max, const struct timespec* deadline) {
+    mtx_lock(&ring->mutex);
+    size_t count = ringTake(ring, items, max);
+    if (count == 0) {
+        Waiter me;
+        pushWaiter(&ring->consumersHead, &ring->consumersTail, &me);
+        ring->waitingCount++;
+        TRACE(TRACE_WAIT, NULL, ring->waitingCount);
+        if (!awaitWaiter(&me, &ring->mutex, deadline)) {
+            removeWaiter(&ring->consumersHead, &ring->consumersTail, &me);
+            ring->waitingCount--;
+            mtx_unlock(&ring->mutex);
+            return 0;
+        }
+        items[count++] = me.item; // A producer handed us an item
+        if (count == max) {
+            TRACE(TRACE_DEQUEUE_BATCH, items[0], count);
+            return count;
+        }
+        mtx_lock(&ring->mutex); // Take items a batch enqueue put behind ours
+        count += ringTake(ring, items + count, max - count);
+    }
+    TRACE(TRACE_DEQUEUE_BATCH, items[0], count);
+    mtx_unlock(&ring->mutex);
+    return count;
+}
+
+// Put n items in the ring, in order, waiting for room if block is set. Returns how many were put,
+// which is less than n only if the ring filled up and block is not set
+static size_t ringPutBatch(Ring* ring, void** items, size_t n, bool block) {
+    size_t count = 0;
+    mtx_lock(&ring->mutex);
+    while (count < n && ringPut(ring, items[count], block)) {
+        count++;
+    }
+    mtx_unlock(&ring->mutex);
+    return count;
+}
+
+// Free the ring of a bounded queue
+static void destroyRing(Ring* ring) {
+    mtx_destroy(&ring->mutex); // Waiter entries live on their threads' stacks
+    free(ring->slots);
+    free(ring);
+}
+
+// Create an empty queue. Returns NULL if out of memory
+Queue* queue_create(void) {
+    return fifoCreate();
+}
+
+// Create an empty sharded queue with the given number of shards, or one per online CPU if 0.
+// Returns NULL if out of memory
+Queue* queue_create_sharded(size_t shards) {
+    if (shards == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shards = cpus > 0 ? (size_t)cpus : 1;
+    }
+    Queue* q = fifoCreate(); // Only its sharded field is used
+    ShardSet* set = (ShardSet*)aligned_alloc(CACHE_LINE, sizeof(ShardSet));
+    Queue** array = (Queue**)calloc(shards, sizeof(Queue*));
+    if (q == NULL || set == NULL || array == NULL) {
+        free(array);
+        free(set);
+        if (q != NULL) {
+            fifoDestroy(q);
+        }
+        return NULL;
+    }
+    set->count = 0;
+    set->shards = array;
+    atomic_init(&set->waitingCount, 0);
+    mtx_init(&set->parkMutex, mtx_plain);
+    set->parkedHead = NULL;
+    set->parkedTail = NULL;
+    while (set->count < shards) {
+        if ((array[set->count] = fifoCreate()) == NULL) {
+            destroyShards(set);
+            fifoDestroy(q);
+            return NULL;
+        }
+        set->count++;
+    }
+    q->sharded = set;
+    return q;
+}
+
+// Create an empty bounded queue holding up to capacity items (at least 1). Returns NULL if out of memory
+Queue* queue_create_bounded(size_t capacity) {
+    Queue* q = fifoCreate(); // Only its bounded field is used
+    Ring* ring = (Ring*)aligned_alloc(CACHE_LINE, sizeof(Ring));
+    void** slots = (void**)calloc(capacity > 0 ? capacity : 1, sizeof(void*));
+    if (q == NULL || ring == NULL || slots == NULL) {
+        free(slots);
+        free(ring);
+        if (q != NULL) {
+            fifoDestroy(q);
+        }
+        return NULL;
+    }
+    mtx_init(&ring->mutex, mtx_plain);
+    ring->first = 0;
+    ring->count = 0;
+    ring->visitedCount = 0;
+    ring->consumersHead = NULL;
+    ring->consumersTail = NULL;
+    ring->waitingCount = 0;
+    ring->producersHead = NULL;
+    ring->producersTail = NULL;
+    ring->capacity = capacity > 0 ? capacity : 1;
+    ring->slots = slots;
+    q->bounded = ring;
+    return q;
+}
+
+// Destroy a queue and free resources. No other thread may use the queue anymore
+void queue_destroy(Queue* q) {
+    if (q->sharded != NULL) {
+        destroyShards(q->sharded);
+    }
+    if (q->bounded != NULL) {
+        destroyRing(q->bounded);
+    }
+    fifoDestroy(q);
+}
 
-    mtx_unlock(&queue.mutex);
+// Wait a little for dequeues to give nodes back to the pool, when it is out of memory
+static void awaitMemory(void) {
+    thrd_sleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+}
+
+// Enqueue an item into an unbounded queue. Returns false if out of memory
+static bool enqueueNode(Queue* q, void* item) {
+    ShardSet* set = q->sharded;
+    if (set == NULL) {
+        return fifoEnqueue(q, item);
+    }
+    if (!fifoEnqueue(set->shards[shardOf(set)], item)) {
+        return false;
+    }
+    wakeParked(set, 1);
     return true;
 }
 
+// Enqueue an item into the queue. Blocks while a bounded queue is full, or while out of memory
+// until dequeues free some
+void queue_enqueue(Queue* q, void* item) {
+    if (q->bounded != NULL) {
+        ringPutBatch(q->bounded, &item, 1, true);
+        return;
+    }
+    while (!enqueueNode(q, item)) {
+        awaitMemory();
+    }
+}
+
+// Try to enqueue an item without blocking. Fails only if a bounded queue is full or out of memory
+bool queue_try_enqueue(Queue* q, void* item) {
+    if (q->bounded != NULL) {
+        return ringPutBatch(q->bounded, &item, 1, false) == 1;
+    }
+    return enqueueNode(q, item);
+}
+
+// Enqueue n items at once, in order. Blocks while a bounded queue is full, or while out of memory
+// until dequeues free some
+void queue_enqueue_batch(Queue* q, void** items, size_t n) {
+    ShardSet* set = q->sharded;
+    if (q->bounded != NULL) {
+        ringPutBatch(q->bounded, items, n, true);
+        return;
+    }
+    Queue* target = set == NULL ? q : set->shards[shardOf(set)];
+    while (!fifoEnqueueBatch(target, items, n)) {
+        awaitMemory();
+    }
+    if (set != NULL) {
+        wakeParked(set, n);
+    }
+}
+
+// Dequeue an item from the queue (blocks if empty)
+void* queue_dequeue(Queue* q) {
+    void* item;
+    if (q->bounded != NULL) {
+        ringAwait(q->bounded, &item, 1, NULL);
+    } else if (q->sharded != NULL) {
+        awaitShards(q->sharded, &item, 1, NULL);
+    } else {
+        item = fifoDequeue(q);
+    }
+    return item;
+}
+
+// Dequeue up to max items, blocking until there is at least one. Returns how many
+size_t queue_dequeue_batch(Queue* q, void** items, size_t max) {
+    if (max == 0) {
+        return 0;
+    }
+    if (q->bounded != NULL) {
+        return ringAwait(q->bounded, items, max, NULL);
+    }
+    if (q->sharded != NULL) {
+        return awaitShards(q->sharded, items, max, NULL);
+    }
+    return fifoDequeueBatch(q, items, max);
+}
+
+// Dequeue an item, waiting no later than deadline (an absolute TIME_UTC time, as for
+// cnd_timedwait; NULL waits forever). Returns false if the deadline passed with no item
+bool queue_dequeue_timeout(Queue* q, void** item, const struct timespec* deadline) {
+    if (q->bounded != NULL) {
+        return ringAwait(q->bounded, item, 1, deadline) == 1;
+    }
+    if (q->sharded != NULL) {
+        return awaitShards(q->sharded, item, 1, deadline) == 1;
+    }
+    return fifoDequeueTimeout(q, item, deadline);
+}
+
+// Try to dequeue an item from the queue without blocking
+bool queue_try_dequeue(Queue* q, void** item) {
+    if (q->bounded != NULL) {
+        return queue_try_dequeue_batch(q, item, 1) == 1;
+    }
+    if (q->sharded == NULL) {
+        return fifoTryDequeue(q, item);
+    }
+    return takeShards(q->sharded, item, 1) > 0;
+}
+
+// Try to dequeue up to max items without blocking. Returns how many
+size_t queue_try_dequeue_batch(Queue* q, void** items, size_t max) {
+    if (q->bounded != NULL) {
+        mtx_lock(&q->bounded->mutex);
+        size_t count = ringTake(q->bounded, items, max);
+        TRACE(TRACE_DEQUEUE_BATCH, count > 0 ? items[0] : NULL, count);
+        mtx_unlock(&q->bounded->mutex);
+        return count;
+    }
+    if (q->sharded == NULL) {
+        return fifoTryDequeueBatch(q, items, max);
+    }
+    return max == 0 ? 0 : takeShards(q->sharded, items, max);
+}
+
+// Get the current number of items in the queue
+size_t queue_size(Queue* q) {
+    if (q->bounded != NULL) {
+        return q->bounded->count;
+    }
+    if (q->sharded == NULL) {
+        return fifoSize(q);
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < q->sharded->count; i++) {
+        total += fifoSize(q->sharded->shards[i]);
+    }
+    return total;
+}
+
+// Get the total number of items that have passed through the queue
+size_t queue_visited(Queue* q) {
+    if (q->bounded != NULL) {
+        return q->bounded->visitedCount;
+    }
+    if (q->sharded == NULL) {
+        return fifoVisited(q);
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < q->sharded->count; i++) {
+        total += fifoVisited(q->sharded->shards[i]);
+    }
+    return total;
+}
+
+// Get the current number of threads waiting for an item
+size_t queue_waiting(Queue* q) {
+    if (q->bounded != NULL) {
+        return q->bounded->waitingCount;
+    }
+    if (q->sharded == NULL) {
+        return fifoWaiting(q);
+    }
+    return atomic_load(&q->sharded->waitingCount);
+}
+
+#ifdef QUEUE_TRACE
+// Print the events still in the ring, oldest first. Events being overwritten are skipped
+void queueTraceDump(FILE* out) {
+    size_t end = atomic_load(&traceLog.next);
+    size_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    for (size_t position = start; position < end; position++) {
+        TraceEvent* event = &traceLog.events[position & (TRACE_EVENTS - 1)];
+        if (atomic_load_explicit(&event->seq, memory_order_acquire) != position + 1) {
+            continue;
+        }
+        uint64_t time = atomic_load_explicit(&event->time, memory_order_relaxed);
+        uintptr_t thread = atomic_load_explicit(&event->thread, memory_order_relaxed);
+        const void* item = atomic_load_explicit(&event->item, memory_order_relaxed);
+        size_t value = atomic_load_explicit(&event->value, memory_order_relaxed);
+        int kind = atomic_load_explicit(&event->kind, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&event->seq, memory_order_relaxed) != position + 1) {
+            continue; // Overwritten while we read it
+        }
+        fprintf(out, "%llu.%09llu thread %lx %s item %p value %zu\n",
+                (unsigned long long)(time / 1000000000u), (unsigned long long)(time % 1000000000u),
+                (unsigned long)thread, traceNames[kind], item, value);
+    }
+}
+#endif
+
+// The global queue of the original API, a thin wrapper around one handle. Building with
+// -DQUEUE_CAPACITY=N makes it a bounded queue of N items, building with -DQUEUE_SHARDED a sharded
+// queue with one shard per online CPU
+static Queue* globalQueue;
+
+// Initialize the queue
+void initQueue(void) {
+#if defined(QUEUE_CAPACITY)
+    globalQueue = queue_create_bounded(QUEUE_CAPACITY);
+#elif defined(QUEUE_SHARDED)
+    globalQueue = queue_create_sharded(0);
+#else
+    globalQueue = queue_create();
+#endif
+}
+
+// Destroy the queue and free resources
+void destroyQueue(void) {
+    queue_destroy(globalQueue);
+    globalQueue = NULL;
+}
+
+// Enqueue an item into the queue
+void enqueue(void* item) {
+    queue_enqueue(globalQueue, item);
+}
+
+// Try to enqueue an item without blocking. Fails only if a bounded queue is full or out of memory
+bool tryEnqueue(void* item) {
+    return queue_try_enqueue(globalQueue, item);
+}
+
+// Enqueue n items at once, in order
+void enqueueBatch(void** items, size_t n) {
+    queue_enqueue_batch(globalQueue, items, n);
+}
+
+// Dequeue an item from the queue (blocks if empty)
+void* dequeue(void) {
+    return queue_dequeue(globalQueue);
+}
+
+// Dequeue up to max items, blocking until there is at least one. Returns how many
+size_t dequeueBatch(void** items, size_t max) {
+    return queue_dequeue_batch(globalQueue, items, max);
+}
+
+// Dequeue an item, waiting no later than deadline (TIME_UTC, NULL for none). Returns false on timeout
+bool dequeueTimeout(void** item, const struct timespec* deadline) {
+    return queue_dequeue_timeout(globalQueue, item, deadline);
+}
+
+// Try to dequeue an item from the queue without blocking
+bool tryDequeue(void** item) {
+    return queue_try_dequeue(globalQueue, item);
+}
+
+// Try to dequeue up to max items without blocking. Returns how many
+size_t tryDequeueBatch(void** items, size_t max) {
+    return queue_try_dequeue_batch(globalQueue, items, max);
+}
+
 // Get the current number of items in the queue
 size_t size(void) {
-    return queue.count;
+    return queue_size(globalQueue);
 }
 
 // Get the total number of items that have passed through the queue
 size_t visited(void) {
-    return queue.visitedCount;
+    return queue_visited(globalQueue);
 }
 
 // Get the current number of threads waiting for an item
 size_t waiting(void) {
-    return queue.waitingCount;
+    return queue_waiting(globalQueue);
 }
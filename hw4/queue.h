@@ -1,11 +1,41 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
 void initQueue(void);
 void destroyQueue(void);
 void enqueue(void*);
+bool tryEnqueue(void*);
 void* dequeue(void);
+bool dequeueTimeout(void**, const struct timespec*);
 bool tryDequeue(void**);
+void enqueueBatch(void**, size_t);
+size_t dequeueBatch(void**, size_t);
+size_t tryDequeueBatch(void**, size_t);
 size_t size(void);
 size_t waiting(void);
 size_t visited(void);
+
+// Independent queues; the functions above work on a global one
+typedef struct Queue Queue;
+Queue* queue_create(void);
+Queue* queue_create_sharded(size_t);
+Queue* queue_create_bounded(size_t);
+void queue_destroy(Queue*);
+void queue_enqueue(Queue*, void*);
+bool queue_try_enqueue(Queue*, void*);
+void* queue_dequeue(Queue*);
+bool queue_dequeue_timeout(Queue*, void**, const struct timespec*);
+bool queue_try_dequeue(Queue*, void**);
+void queue_enqueue_batch(Queue*, void**, size_t);
+size_t queue_dequeue_batch(Queue*, void**, size_t);
+size_t queue_try_dequeue_batch(Queue*, void**, size_t);
+size_t queue_size(Queue*);
+size_t queue_waiting(Queue*);
+size_t queue_visited(Queue*);
+
+#ifdef QUEUE_TRACE
+#include <stdio.h>
+// Print the traced queue operations still in memory, oldest first
+void queueTraceDump(FILE*);
+#endif
@@ -0,0 +1,73 @@
+#ifndef QUEUE_TRACE_H
+#define QUEUE_TRACE_H
+
+// Tracing of queue operations. Built with -DQUEUE_TRACE, every trace point appends an event to a
+// fixed ring in memory (lock-free, oldest events are overwritten) that queueTraceDump (queue.h) prints.
+// Otherwise TRACE expands to nothing, so the queue does no tracing work at all
+
+// Kinds of traced events
+typedef enum {
+    TRACE_ENQUEUE,       // item was queued; value is the queue size after
+    TRACE_HANDOVER,      // item went straight to a waiting thread
+    TRACE_DEQUEUE,       // item was dequeued; value is the queue size after
+    TRACE_TRY_DEQUEUE,   // tryDequeue got item, or nothing if item is NULL
+    TRACE_WAIT,          // The thread starts waiting; value is the number of waiting threads
+    TRACE_WAKE,          // value waiting threads were woken
+    TRACE_ENQUEUE_BATCH, // value items were enqueued, the first being item
+    TRACE_DEQUEUE_BATCH, // value items were dequeued, the first being item
+} TraceKind;
+
+#ifdef QUEUE_TRACE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <threads.h>
+
+#define TRACE_EVENTS 4096 // Events kept; a power of two
+
+// Structure for a traced event. seq is 0 while the event is being written, then its position + 1
+typedef struct {
+    atomic_size_t seq;
+    _Atomic uint64_t time;       // CLOCK_MONOTONIC, in nanoseconds
+    _Atomic uintptr_t thread;
+    _Atomic(const void*) item;
+    atomic_size_t value;
+    atomic_int kind;
+} TraceEvent;
+
+static struct {
+    atomic_size_t next;        // Position of the next event
+    TraceEvent events[TRACE_EVENTS];
+} traceLog;
+
+static const char* const traceNames[] = {
+    "enqueue", "handover", "dequeue", "tryDequeue", "wait", "wake", "enqueueBatch", "dequeueBatch",
+};
+
+// Append an event to the ring
+static void traceEvent(TraceKind kind, const void* item, size_t value) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t position = atomic_fetch_add_explicit(&traceLog.next, 1, memory_order_relaxed);
+    TraceEvent* event = &traceLog.events[position & (TRACE_EVENTS - 1)];
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // seq reads 0 before any field changes
+    atomic_store_explicit(&event->time, (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec, memory_order_relaxed);
+    atomic_store_explicit(&event->thread, (uintptr_t)thrd_current(), memory_order_relaxed);
+    atomic_store_explicit(&event->item, item, memory_order_relaxed);
+    atomic_store_explicit(&event->value, value, memory_order_relaxed);
+    atomic_store_explicit(&event->kind, kind, memory_order_relaxed);
+    atomic_store_explicit(&event->seq, position + 1, memory_order_release);
+}
+
+#define TRACE(kind, item, value) traceEvent((kind), (item), (value))
+
+#else
+
+#define TRACE(kind, item, value) ((void)0)
+
+#endif // QUEUE_TRACE
+
+#endif // QUEUE_TRACE_H
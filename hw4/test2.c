@@ -1,6 +1,14 @@
+// Tests of the queue. Run them against both implementations:
+//   gcc -std=c11 -D_POSIX_C_SOURCE=200809 -Wall -o test2 test2.c && ./test2
+//   gcc -std=c11 -D_POSIX_C_SOURCE=200809 -Wall -DQUEUE_LOCKFREE -o test2 test2.c && ./test2
+// and with -DQUEUE_TRACE added to either, which also checks the trace dump
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // Before any system header, for syscall in queue.c
+#endif
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include "queue.c"
@@ -10,6 +18,9 @@
 #define NUM_THREADS_CONC 100
 #define NUM_THREADS 50
 #define SECOND_IN_NANOSECONDS 1000000000
+#define MPMC_THREADS 4
+#define MPMC_ITEMS 20000
+#define STRESS_BATCH 8
 
 int dequeue_with_sleep(void *arg);
 int enqueueItems(void *arg);
@@ -17,6 +28,16 @@ int enqueue_thread(void *arg);
 int dequeue_thread(void *arg);
 int consumer_thread(void *arg);
 int producer_thread(void *arg);
+int batch_dequeue_thread(void *arg);
+int sharded_enqueue_thread(void *arg);
+int sharded_dequeue_thread(void *arg);
+int bounded_enqueue_thread(void *arg);
+int delayed_enqueue_thread(void *arg);
+int mpmc_producer_thread(void *arg);
+int mpmc_consumer_thread(void *arg);
+int node_cache_thread(void *arg);
+int batch_stress_producer(void *arg);
+int batch_stress_consumer(void *arg);
 
 void test_destroyQueue()
 {
@@ -530,6 +551,653 @@ void test_mixed_operations()
     printf("mixed operations test passed.\n");
 }
 
+int batch_dequeue_thread(void *arg)
+{
+    void **items = (void **)arg;
+
+    // Blocks until the batch below arrives, then takes as much of it as it can
+    size_t count = dequeueBatch(items, NUM_OPERATIONS);
+    printf("Batch dequeued %zu items\n", count);
+
+    return (int)count;
+}
+
+void test_batch()
+{
+    printf("=== Testing batch operations ===\n");
+
+    initQueue();
+
+    int items[NUM_OPERATIONS];
+    void *batch[NUM_OPERATIONS];
+    void *out[NUM_OPERATIONS];
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        items[i] = i + 1;
+        batch[i] = &items[i];
+    }
+
+    // Nothing to take from an empty queue
+    assert(tryDequeueBatch(out, NUM_OPERATIONS) == 0);
+
+    // Batches keep FIFO order across calls
+    enqueueBatch(batch, 3);
+    enqueueBatch(batch + 3, NUM_OPERATIONS - 3);
+    assert(size() == NUM_OPERATIONS);
+    assert(tryDequeueBatch(out, 2) == 2);
+    assert(out[0] == &items[0] && out[1] == &items[1]);
+    assert(dequeueBatch(out, NUM_OPERATIONS) == NUM_OPERATIONS - 2);
+    for (int i = 2; i < NUM_OPERATIONS; i++)
+    {
+        assert(out[i - 2] == &items[i]);
+    }
+    assert(size() == 0);
+    assert(visited() == NUM_OPERATIONS);
+
+    // A batch wakes a thread blocked in dequeueBatch, which gets the first items
+    thrd_t thread;
+    int count;
+    thrd_create(&thread, batch_dequeue_thread, out);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueBatch(batch, NUM_OPERATIONS);
+    thrd_join(thread, &count);
+    assert(count >= 1);
+    for (int i = 0; i < count; i++)
+    {
+        assert(out[i] == &items[i]);
+    }
+    assert(tryDequeueBatch(out, NUM_OPERATIONS) == (size_t)(NUM_OPERATIONS - count));
+    for (int i = count; i < NUM_OPERATIONS; i++)
+    {
+        assert(out[i - count] == &items[i]);
+    }
+    assert(waiting() == 0);
+    assert(visited() == 2 * NUM_OPERATIONS);
+
+    destroyQueue();
+
+    printf("batch operations test passed.\n");
+}
+
+void test_handles()
+{
+    printf("=== Testing independent queues ===\n");
+
+    Queue *first = queue_create();
+    Queue *second = queue_create();
+    assert(first != NULL && second != NULL);
+
+    int items[] = {1, 2, 3};
+    queue_enqueue(first, &items[0]);
+    queue_enqueue(second, &items[1]);
+    queue_enqueue(first, &items[2]);
+    assert(queue_size(first) == 2);
+    assert(queue_size(second) == 1);
+
+    // Each queue keeps its own items and counters
+    assert(queue_dequeue(second) == &items[1]);
+    void *item;
+    assert(!queue_try_dequeue(second, &item));
+    assert(queue_visited(second) == 1);
+    assert(queue_visited(first) == 0);
+
+    // Destroying one queue leaves the other intact, items included
+    queue_destroy(second);
+    assert(queue_dequeue(first) == &items[0]);
+    assert(queue_try_dequeue(first, &item) && item == &items[2]);
+    assert(queue_size(first) == 0);
+    assert(queue_visited(first) == 2);
+    assert(queue_waiting(first) == 0);
+    queue_destroy(first);
+
+    printf("independent queues test passed.\n");
+}
+
+int sharded_enqueue_thread(void *arg)
+{
+    Queue *queue = (Queue *)arg;
+    static int items[NUM_OPERATIONS];
+
+    // Every thread has its own shard; these land in this thread's
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        queue_enqueue(queue, &items[i]);
+    }
+
+    return 0;
+}
+
+int sharded_dequeue_thread(void *arg)
+{
+    Queue *queue = (Queue *)arg;
+
+    // Parks until another thread's shard gets an item, then steals it
+    return queue_dequeue(queue) != NULL;
+}
+
+void test_sharded()
+{
+    printf("=== Testing sharded queue ===\n");
+
+    Queue *queue = queue_create_sharded(4);
+    assert(queue != NULL);
+
+    // Items enqueued by other threads are stolen, and counters add up over all shards
+    thrd_t threads[3];
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_create(&threads[i], sharded_enqueue_thread, queue);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    assert(queue_size(queue) == 3 * NUM_OPERATIONS);
+    void *item;
+    for (int i = 0; i < 3 * NUM_OPERATIONS; i++)
+    {
+        assert(queue_try_dequeue(queue, &item));
+    }
+    assert(!queue_try_dequeue(queue, &item));
+    assert(queue_size(queue) == 0);
+    assert(queue_visited(queue) == 3 * NUM_OPERATIONS);
+
+    // A thread parks while all shards are empty
+    thrd_t thread;
+    int result;
+    thrd_create(&thread, sharded_dequeue_thread, queue);
+    while (queue_waiting(queue) == 0)
+    {
+        thrd_yield();
+    }
+    int last = 0;
+    queue_enqueue(queue, &last);
+    thrd_join(thread, &result);
+    assert(result == 1);
+    assert(queue_waiting(queue) == 0);
+    assert(queue_visited(queue) == 3 * NUM_OPERATIONS + 1);
+
+    queue_destroy(queue);
+
+    printf("sharded queue test passed.\n");
+}
+
+int bounded_enqueue_thread(void *arg)
+{
+    Queue *queue = (Queue *)arg;
+    static int blocked = 4;
+
+    // The ring is full, so this blocks until a dequeue makes room
+    queue_enqueue(queue, &blocked);
+
+    return 0;
+}
+
+// Tell whether a producer is blocked on a full bounded queue
+bool producer_blocked(Queue *queue)
+{
+    mtx_lock(&queue->bounded->mutex);
+    bool blocked = queue->bounded->producersHead != NULL;
+    mtx_unlock(&queue->bounded->mutex);
+    return blocked;
+}
+
+void test_bounded()
+{
+    printf("=== Testing bounded queue ===\n");
+
+    Queue *queue = queue_create_bounded(3);
+    assert(queue != NULL);
+
+    int items[] = {1, 2, 3, 4};
+    assert(queue_try_enqueue(queue, &items[0]));
+    queue_enqueue(queue, &items[1]);
+    assert(queue_try_enqueue(queue, &items[2]));
+
+    // Full: tryEnqueue fails and the size stays at the capacity
+    assert(!queue_try_enqueue(queue, &items[3]));
+    assert(queue_size(queue) == 3);
+
+    // A blocked producer gets the slot freed by the next dequeue, keeping FIFO order
+    thrd_t thread;
+    thrd_create(&thread, bounded_enqueue_thread, queue);
+    while (!producer_blocked(queue))
+    {
+        thrd_yield();
+    }
+    assert(queue_size(queue) == 3);
+    assert(queue_dequeue(queue) == &items[0]);
+    thrd_join(thread, NULL);
+    assert(queue_size(queue) == 3);
+    void *out[4];
+    assert(queue_try_dequeue_batch(queue, out, 4) == 3);
+    assert(out[0] == &items[1] && out[1] == &items[2] && *(int *)out[2] == 4);
+    assert(queue_visited(queue) == 4);
+    assert(queue_waiting(queue) == 0);
+
+    queue_destroy(queue);
+
+    printf("bounded queue test passed.\n");
+}
+
+int delayed_enqueue_thread(void *arg)
+{
+    Queue *queue = (Queue *)arg;
+    static int late = 7;
+
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = SECOND_IN_NANOSECONDS / 20}, NULL);
+    queue_enqueue(queue, &late);
+
+    return 0;
+}
+
+// Get an absolute TIME_UTC deadline nanoseconds from now
+struct timespec deadline_in(long nanoseconds)
+{
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += nanoseconds;
+    deadline.tv_sec += deadline.tv_nsec / SECOND_IN_NANOSECONDS;
+    deadline.tv_nsec %= SECOND_IN_NANOSECONDS;
+    return deadline;
+}
+
+void test_dequeue_timeout()
+{
+    printf("=== Testing dequeueTimeout ===\n");
+
+    Queue *queues[] = {queue_create(), queue_create_sharded(2), queue_create_bounded(2)};
+    for (int i = 0; i < 3; i++)
+    {
+        Queue *queue = queues[i];
+        assert(queue != NULL);
+        void *item;
+
+        // Nothing arrives: the wait ends at the deadline and leaves no waiter behind
+        struct timespec deadline = deadline_in(SECOND_IN_NANOSECONDS / 20);
+        assert(!queue_dequeue_timeout(queue, &item, &deadline));
+        struct timespec now;
+        timespec_get(&now, TIME_UTC);
+        assert(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec));
+        assert(queue_waiting(queue) == 0);
+
+        // An item already queued is returned at once, even past the deadline
+        int ready = 5;
+        queue_enqueue(queue, &ready);
+        assert(queue_dequeue_timeout(queue, &item, &deadline));
+        assert(item == &ready);
+
+        // An item enqueued before the deadline is handed to the waiting thread
+        thrd_t thread;
+        thrd_create(&thread, delayed_enqueue_thread, queue);
+        deadline = deadline_in(5L * SECOND_IN_NANOSECONDS);
+        assert(queue_dequeue_timeout(queue, &item, &deadline));
+        assert(*(int *)item == 7);
+        thrd_join(thread, NULL);
+        assert(queue_waiting(queue) == 0);
+        assert(queue_size(queue) == 0);
+        assert(queue_visited(queue) == 2);
+
+        queue_destroy(queue);
+    }
+
+    // The global queue, with no deadline
+    initQueue();
+    int item = 9;
+    enqueue(&item);
+    void *out;
+    assert(dequeueTimeout(&out, NULL));
+    assert(out == &item);
+    destroyQueue();
+
+    printf("dequeueTimeout test passed.\n");
+}
+
+int mpmc_producer_thread(void *arg)
+{
+    uintptr_t producer = (uintptr_t)arg;
+
+    // Items encode their producer and sequence number, counted from 1
+    for (uintptr_t i = 0; i < MPMC_ITEMS; i++)
+    {
+        enqueue((void *)(producer * MPMC_ITEMS + i + 1));
+    }
+
+    return 0;
+}
+
+int mpmc_consumer_thread(void *arg)
+{
+    uintptr_t *sums = (uintptr_t *)arg;
+    uintptr_t last[MPMC_THREADS] = {0};
+
+    // FIFO order means every consumer sees each producer's items in the order they were enqueued
+    for (int i = 0; i < MPMC_ITEMS; i++)
+    {
+        uintptr_t item = (uintptr_t)dequeue() - 1;
+        uintptr_t producer = item / MPMC_ITEMS;
+        uintptr_t sequence = item % MPMC_ITEMS + 1;
+        assert(producer < MPMC_THREADS);
+        assert(sequence > last[producer]);
+        last[producer] = sequence;
+        sums[producer] += sequence;
+    }
+
+    return 0;
+}
+
+void test_mpmc_fifo_order()
+{
+    printf("=== Testing multi-producer multi-consumer FIFO order ===\n");
+
+    initQueue();
+
+    thrd_t producers[MPMC_THREADS];
+    thrd_t consumers[MPMC_THREADS];
+    uintptr_t sums[MPMC_THREADS][MPMC_THREADS] = {{0}};
+
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_create(&consumers[i], mpmc_consumer_thread, sums[i]);
+    }
+    for (uintptr_t i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_create(&producers[i], mpmc_producer_thread, (void *)i);
+    }
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_join(producers[i], NULL);
+        thrd_join(consumers[i], NULL);
+    }
+
+    // Every item was dequeued exactly once
+    for (int producer = 0; producer < MPMC_THREADS; producer++)
+    {
+        uintptr_t sum = 0;
+        for (int consumer = 0; consumer < MPMC_THREADS; consumer++)
+        {
+            sum += sums[consumer][producer];
+        }
+        assert(sum == (uintptr_t)MPMC_ITEMS * (MPMC_ITEMS + 1) / 2);
+    }
+    assert(size() == 0);
+    assert(waiting() == 0);
+    assert(visited() == MPMC_THREADS * MPMC_ITEMS);
+
+    destroyQueue();
+
+    printf("multi-producer multi-consumer FIFO order test passed.\n");
+}
+
+// Count the nodes on the pool's shared free list
+size_t count_free_nodes()
+{
+    size_t count = 0;
+    for (QueueItem *node = ptrOf(atomic_load(&pool.freeTop)); node != NULL; node = atomic_load(&node->poolNext))
+    {
+        count++;
+    }
+    return count;
+}
+
+typedef struct
+{
+    Queue *queue;
+    size_t cached;     // Nodes in the thread's cache when it exits
+    size_t freeBefore; // Nodes on the shared free list at that time
+} NodeCacheTest;
+
+int node_cache_thread(void *arg)
+{
+    NodeCacheTest *test = (NodeCacheTest *)arg;
+    int item = 1;
+
+    for (int i = 0; i < NUM_OPERATIONS * 10; i++)
+    {
+        queue_enqueue(test->queue, &item);
+    }
+    for (int i = 0; i < NUM_OPERATIONS * 10; i++)
+    {
+        assert(queue_dequeue(test->queue) == &item);
+    }
+    test->cached = nodeCache.count;
+    test->freeBefore = count_free_nodes();
+
+    return 0;
+}
+
+void test_node_pool()
+{
+    printf("=== Testing node pool ===\n");
+
+    // A thread's cached nodes go back to the shared free list when it exits
+    NodeCacheTest test = {.queue = queue_create()};
+    assert(test.queue != NULL);
+    thrd_t thread;
+    thrd_create(&thread, node_cache_thread, &test);
+    thrd_join(thread, NULL);
+    assert(test.cached > 0);
+    assert(count_free_nodes() == test.freeBefore + test.cached);
+
+    // While a queue keeps the pool alive, a new queue reuses the nodes of a destroyed one
+    Queue *queue = queue_create();
+    int items[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queue_enqueue(queue, &items[i]);
+    }
+    size_t capacity = pool.capacity;
+    queue_destroy(queue);
+    queue = queue_create();
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queue_enqueue(queue, &items[i]);
+    }
+    assert(pool.capacity == capacity);
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        assert(queue_dequeue(queue) == &items[i]);
+    }
+    queue_destroy(queue);
+    queue_destroy(test.queue);
+
+    // After the last queue goes, the pool starts over: stale cached nodes are not handed out again
+    queue = queue_create();
+    assert(pool.capacity <= SLAB_MIN);
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queue_enqueue(queue, &items[i]);
+    }
+    assert(pool.capacity == capacity);
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        assert(queue_dequeue(queue) == &items[i]);
+    }
+    queue_destroy(queue);
+
+    printf("node pool test passed.\n");
+}
+
+static int stress_stop; // Enqueued once per consumer after all items, to stop it
+
+int batch_stress_producer(void *arg)
+{
+    uintptr_t producer = (uintptr_t)arg;
+    void *items[STRESS_BATCH];
+
+    // Items encode their producer and sequence number, counted from 1, and go in as single
+    // enqueues and batches of varying size
+    for (uintptr_t i = 1; i <= MPMC_ITEMS;)
+    {
+        size_t n = i % STRESS_BATCH + 1;
+        if (n > MPMC_ITEMS - i + 1)
+        {
+            n = MPMC_ITEMS - i + 1;
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            items[j] = (void *)(producer * MPMC_ITEMS + i + j);
+        }
+        if (n == 1)
+        {
+            enqueue(items[0]);
+        }
+        else
+        {
+            enqueueBatch(items, n);
+        }
+        i += n;
+    }
+
+    return 0;
+}
+
+int batch_stress_consumer(void *arg)
+{
+    uintptr_t *sums = (uintptr_t *)arg;
+    uintptr_t last[MPMC_THREADS] = {0};
+    void *items[STRESS_BATCH];
+
+    // Blocking and non-blocking batches of varying size, until a stop item arrives
+    for (size_t round = 0;; round++)
+    {
+        size_t max = round % STRESS_BATCH + 1;
+        size_t count = round % 3 == 0 ? tryDequeueBatch(items, max) : dequeueBatch(items, max);
+        assert(count <= max);
+        size_t stops = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (items[i] == &stress_stop)
+            {
+                stops++;
+                continue;
+            }
+            uintptr_t item = (uintptr_t)items[i] - 1;
+            uintptr_t producer = item / MPMC_ITEMS;
+            uintptr_t sequence = item % MPMC_ITEMS + 1;
+            assert(producer < MPMC_THREADS);
+            assert(stops == 0); // Stop items come after every real one
+            assert(sequence > last[producer]);
+            last[producer] = sequence;
+            sums[producer] += sequence;
+        }
+        if (stops > 0)
+        {
+            while (--stops > 0)
+            {
+                enqueue(&stress_stop); // Leave the others for the other consumers
+            }
+            return 0;
+        }
+    }
+}
+
+void test_batch_stress()
+{
+    printf("=== Testing concurrent dequeueBatch ===\n");
+
+    initQueue();
+
+    thrd_t producers[MPMC_THREADS];
+    thrd_t consumers[MPMC_THREADS];
+    uintptr_t sums[MPMC_THREADS][MPMC_THREADS] = {{0}};
+
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_create(&consumers[i], batch_stress_consumer, sums[i]);
+    }
+    for (uintptr_t i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_create(&producers[i], batch_stress_producer, (void *)i);
+    }
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_join(producers[i], NULL);
+    }
+    while (size() > 0)
+    {
+        thrd_yield(); // A sharded queue could hand out stop items before ones left in other shards
+    }
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        enqueue(&stress_stop);
+    }
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+    }
+
+    // Every item was dequeued exactly once, and a false empty never left a consumer asleep
+    for (int producer = 0; producer < MPMC_THREADS; producer++)
+    {
+        uintptr_t sum = 0;
+        for (int consumer = 0; consumer < MPMC_THREADS; consumer++)
+        {
+            sum += sums[consumer][producer];
+        }
+        assert(sum == (uintptr_t)MPMC_ITEMS * (MPMC_ITEMS + 1) / 2);
+    }
+    assert(size() == 0);
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("concurrent dequeueBatch test passed.\n");
+}
+
+#ifdef QUEUE_TRACE
+void test_trace_dump()
+{
+    printf("=== Testing queueTraceDump ===\n");
+
+    initQueue();
+
+    int item = 1;
+    void *out;
+    enqueue(&item);
+    assert(tryDequeue(&out) && out == &item);
+    assert(!tryDequeue(&out));
+
+    FILE *file = tmpfile();
+    assert(file != NULL);
+    queueTraceDump(file);
+    rewind(file);
+
+    // One line per event, oldest first: our enqueue, then a dequeue of the item, then none has it
+    char expected[64], line[256], last[256] = "";
+    snprintf(expected, sizeof(expected), " item %p value ", (void *)&item);
+    int lines = 0, enqueued = -1, dequeued = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        assert(strchr(line, '\n') != NULL);
+        if (strstr(line, expected) != NULL)
+        {
+            if (strstr(line, " enqueue item ") != NULL)
+            {
+                enqueued = lines;
+            }
+            else if (enqueued >= 0 && dequeued < 0)
+            {
+                dequeued = lines;
+            }
+        }
+        strcpy(last, line);
+        lines++;
+    }
+    fclose(file);
+    assert(enqueued >= 0 && dequeued > enqueued);
+    assert(strstr(last, expected) == NULL); // The failed tryDequeue
+    assert(strstr(last, " tryDequeue item ") != NULL || strstr(last, " dequeueBatch item ") != NULL);
+
+    destroyQueue();
+
+    printf("queueTraceDump test passed.\n");
+}
+#endif
+
 int main()
 {
     test_destroyQueue();
@@ -544,6 +1212,17 @@ int main()
     test_enqueue_dequeue_with_sleep();
     test_edge_cases();
     test_mixed_operations();
+    test_batch();
+    test_handles();
+    test_sharded();
+    test_bounded();
+    test_dequeue_timeout();
+    test_mpmc_fifo_order();
+    test_node_pool();
+    test_batch_stress();
+#ifdef QUEUE_TRACE
+    test_trace_dump();
+#endif
 
     return 0;
 }
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // Before any system header, for syscall in queue.c
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <threads.h>